@@ -1,8 +1,112 @@
+/* For mremap(). */
+#define _GNU_SOURCE
+
 #include <assert.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* The stack gets address space for VMConfig.stackLimit entries up front,
+   but memory only STACK_COMMIT bytes at a time as it fills up. */
+#define STACK_COMMIT (64 * 1024)
+
+/* How much the VM tells you about what it's up to. At 0 the tracing isn't
+   even compiled in. At 1 you hear about every collection, and at 2 about
+   every allocation and push as well. The Makefile sets this. */
+#ifndef BABYVM_TRACE
+#define BABYVM_TRACE 0
+#endif
+
+/* Define BABYVM_DEBUG to check the whole heap with verifyHeap() after
+   every collection, and that nothing stores into an immortal object. It's
+   slow, so only `make debug` does. */
+#ifdef BABYVM_DEBUG
+#define VERIFY_HEAP(vm) assert(verifyHeap(vm) == 0)
+#else
+#define VERIFY_HEAP(vm) do { } while(0)
+#endif
+
+/* How much trace output each thread holds on to before writing it out. */
+#define TRACE_BUFFER_SIZE (64 * 1024)
+
+/* The size of each chunk of memory we carve Objects out of. It needs to be a
+   power of two, since chunks are aligned to their size and that's how we get
+   from an Object back to the chunk it lives in. */
+#define CHUNK_SIZE (64 * 1024)
+/* Room at the front of each chunk for the chunk's own bookkeeping. */
+#define CHUNK_HEADER_SIZE 1024
+/* How many gray objects we make room for the first time we mark. */
+#define GRAY_STACK_INITIAL 256
+/* How many gray objects marking prefetches ahead of the one it's tracing. */
+#define MARK_PREFETCH 8
+/* How many old objects we make room for in the remembered set at first. */
+#define REMEMBERED_INITIAL 64
+/* How many objects each parallel marking thread's deque holds at first. */
+#define DEQUE_INITIAL 1024
+/* How many chunk pointers the VM makes room for at first. */
+#define CHUNKS_INITIAL 16
+/* How many empty chunks the process keeps around for the next VM that
+   wants one, rather than giving them back to malloc. */
+#define CHUNK_POOL_MAX 256
+/* Array and byte buffer payloads at least this big get pages of their own
+   from mmap, smaller ones come from malloc. */
+#define LARGE_MMAP_MIN (16 * 1024)
+/* How many objects the program's write barrier collects before handing them
+   to the concurrent marker. */
+#define SATB_BUFFER_SIZE 256
+/* Pretenuring looks again at an allocation site once PRETENURE_WINDOW of
+   its objects have been born young since it last did, and has the site's
+   objects born old if at least PRETENURE_PERCENT percent of the young ones
+   got promoted. One in PRETENURE_PROBE of a pretenured site's objects are
+   still born young, so we notice if that stops being true. */
+#define PRETENURE_WINDOW 256
+#define PRETENURE_PERCENT 80
+#define PRETENURE_PROBE 16
+
+/* Bits for Object.flags used by the generational collector. */
+#define OBJECT_OLD        0x01 /* Promoted out of the nursery, or born old. */
+#define OBJECT_REMEMBERED 0x02 /* Sitting in the VM's remembered set. */
+#define OBJECT_UNSWEPT    0x20 /* Born marked ahead of a lazy sweep. */
+/* Bits for Object.flags used by the copying collector. */
+#define OBJECT_FORWARDED  0x04 /* Copied to to-space, head is the new address. */
+/* Bits for Object.flags used by pushInterned(). */
+#define OBJECT_INTERNED   0x10 /* In the intern table, and immortal. */
+/* Bits for Object.flags used by verifyHeap(). */
+#define OBJECT_VERIFIED   0x08 /* Already checked on this walk of the heap. */
+
+/* Where the objects start in a snapshot file. It has to be a whole number
+   of pages, whatever the page size. */
+#define SNAPSHOT_ALIGN (64 * 1024)
+/* How many snapshots can be loaded at once, across every VM. */
+#define SNAPSHOTS_MAX 64
 
-#define STACK_MAX 256
+/* The smallest semi-space the copying collector will use. */
+#define SEMISPACE_MIN 64
+
+/* How far the adaptive heuristic will let heapGrowth go, and how much it
+   moves it after any one collection. */
+#define HEAP_GROWTH_MIN 1.1
+#define HEAP_GROWTH_MAX 16.0
+#define HEAP_GROWTH_STEP 2.0
+
+/* The pause histogram has PAUSE_SUB_BUCKETS buckets for every power of two
+   nanoseconds, so whatever it tells you is within an eighth or so. */
+#define PAUSE_SUB_BITS 3
+#define PAUSE_SUB_BUCKETS (1 << PAUSE_SUB_BITS)
+#define PAUSE_BUCKETS ((64 - PAUSE_SUB_BITS) * PAUSE_SUB_BUCKETS)
 
 /* This is an implementation of a Naïve mark-and-sweep garbage collector as explained by
    Bob Nystrom at http://journal.stuffwithstuff.com/2013/12/08/babys-first-garbage-collector/.
@@ -11,223 +115,4773 @@
    http://en.wikipedia.org/wiki/Garbage_collection_(computer_science)#Na.C3.AFve_mark-and-sweep
 */
 
-/* Our language has two types, INT and PAIR. PAIR can contain more pairs
-   or ints. Yay! */
+#if BABYVM_TRACE > 0
+
+/* Tracing used to be a printf on stdout every time anything happened, which
+   took longer than the things it was telling you about. Now each thread
+   formats into a buffer of its own and only writes it out once it's full,
+   or when traceFlush() is called, and threads that want their own output
+   file can have one. */
+
+/* Where trace output goes, stdout unless traceToFile() says otherwise. */
+FILE* traceSink = NULL;
+/* Where this thread's trace output goes, if it's different. */
+_Thread_local FILE* traceThreadSink = NULL;
+_Thread_local char traceBuffer[TRACE_BUFFER_SIZE];
+_Thread_local int traceUsed = 0;
+pthread_once_t traceOnce = PTHREAD_ONCE_INIT;
+
+FILE* traceFile() {
+  if(traceThreadSink) return traceThreadSink;
+  return traceSink ? traceSink : stdout;
+}
+
+/* Write out whatever this thread has buffered. */
+void traceFlush() {
+  if(traceUsed == 0) return;
+  fwrite(traceBuffer, 1, traceUsed, traceFile());
+  traceUsed = 0;
+}
+
+/* Make sure the main thread's trace gets written out when we exit. */
+void traceRegisterFlush() {
+  atexit(traceFlush);
+}
+
+void traceToFile(FILE* sink) {
+  traceFlush();
+  traceSink = sink;
+}
+
+void traceThreadToFile(FILE* sink) {
+  traceFlush();
+  traceThreadSink = sink;
+}
+
+void traceWrite(const char* format, ...) {
+  pthread_once(&traceOnce, traceRegisterFlush);
+
+  va_list args;
+  va_start(args, format);
+  int room = TRACE_BUFFER_SIZE - traceUsed;
+  int length = vsnprintf(traceBuffer + traceUsed, room, format, args);
+  va_end(args);
+
+  if(length >= room) {
+    /* It didn't fit, so make room and try again. If it's never going to
+       fit just write it straight out. */
+    traceFlush();
+    va_start(args, format);
+    if(length >= TRACE_BUFFER_SIZE) {
+      vfprintf(traceFile(), format, args);
+      length = 0;
+    } else {
+      vsnprintf(traceBuffer, TRACE_BUFFER_SIZE, format, args);
+    }
+    va_end(args);
+  }
+  traceUsed += length;
+}
+
+#define TRACE(level, ...) do { if((level) <= BABYVM_TRACE) traceWrite(__VA_ARGS__); } while(0)
+
+#else
+
+#define TRACE(level, ...) do { } while(0)
+#define traceFlush() do { } while(0)
+#define traceToFile(sink) do { (void)(sink); } while(0)
+#define traceThreadToFile(sink) do { (void)(sink); } while(0)
+
+#endif
+
+/* Our language has five types, INT, PAIR, ARRAY, BYTES and WEAK. PAIR can
+   contain more pairs or ints, or anything else, and so can each element
+   of an ARRAY. BYTES is a buffer of raw bytes, for strings and the like.
+   WEAK is a weak reference: it points at something without keeping it
+   alive. Yay! Ints don't live in the heap though, they're squeezed into a
+   Value (see below), so they aren't a kind of Object. */
 typedef enum {
-  OBJ_INT,
-  OBJ_PAIR
+  OBJ_PAIR,
+  OBJ_ARRAY,
+  OBJ_BYTES,
+  OBJ_WEAK
 } ObjectType;
 
-/* Our language's Object. */
+/* Something our language can hold on to, on the stack or in one of a
+   pair's fields: either a pointer to an Object or an int. Objects are
+   always at least 8-byte aligned, so a pointer to one has its bottom bit
+   clear. A Value with its bottom bit set is an int instead, kept in the
+   rest of the bits, which means making an int never needs the heap and
+   the GC never has to look at one. NIL_VALUE is what's in a new pair's
+   fields before anything is put there. */
+typedef uintptr_t Value;
+#define NIL_VALUE ((Value)0)
+
+_Static_assert(sizeof(Value) > sizeof(int), "A Value needs room for an int and the tag bit");
+_Static_assert(OBJ_WEAK <= 255, "ObjectType has to fit in a byte");
+
+/* The payload of an array or byte buffer. These live in the large object
+   space rather than a chunk: big ones get pages of their own straight from
+   mmap, so they're page aligned and go straight back to the OS when
+   they're freed, and small ones come from malloc. Either way they never
+   move, not even for the copying collector, which only moves the Object
+   that owns them. The VM keeps them on a list of their own, which is how
+   they're swept. */
+typedef struct sLargeObject {
+  struct sLargeObject* next;
+  /* The Object whose payload this is. */
+  struct sObject* owner;
+  /* How many bytes this takes up, this header included. */
+  size_t size;
+  /* An array's elements, or a byte buffer's bytes. */
+  Value values[];
+} LargeObject;
+
+/* Our language's Object. The header is a single word: the type, how
+   many collections the object has survived while in the nursery, and the
+   OBJECT_* flags the collectors keep on it, all a byte each, and which
+   allocation site it came from. The mark bits live in the chunk instead
+   (see Chunk). */
 typedef struct sObject {
-  /* What type of object is this? */
-  ObjectType type;
-
-  /* Marked for collection. Note that storing this in the object is a bad idea
-     because GC will cause copy-on-write to go nuts in the event you are using
-     fork(). It's good enough for this demo, though. */
-  unsigned char marked;
-
-  /* The VM keeps it's own reference to objects that are distinct
-     from the semantics that are visible to the language user. This field
-     allows us to make the Object a node in the VM's linked list of Objects. */
-  struct sObject* next;
-
-  /* a union to hold the data for the int or pair. If your C is rusty, a
-     union is a struct where the fields overlap in memory. Since a given
-     object can only be an int or a pair, there’s no reason to have memory in
-     a single object for all three fields at the same time. A union does
-     that. Groovy. */
+  /* What type of object is this? An ObjectType, squeezed into a byte. */
+  unsigned char type;
+  unsigned char age;
+  unsigned char flags;
+  /* One more than the index of the site vmSetSite() said we were at when
+     this was allocated, or 0 if it hadn't said. Only pretenuring looks at
+     this, and only the mark-sweep collector keeps it. */
+  unsigned short site;
+
+  /* If your C is rusty, a union is a struct where the fields overlap in
+     memory. A slot in the free list has no fields to speak of, and a pair
+     in use isn't in the free list, so the link to the next free slot can
+     share memory with head and tail. Groovy. */
   union {
-    int value;
+    /* A pair's two fields. A weak reference has these too: head is what
+       it points at, which marking leaves alone, and tail is whatever
+       should be handed back once that's gone. */
+    struct {
+      Value head;
+      Value tail;
+    };
 
+    /* How many elements an array has or how many bytes a byte buffer has,
+       and where they are. */
     struct {
-      struct sObject* head;
-      struct sObject* tail;
+      size_t length;
+      LargeObject* large;
     };
+
+    /* While this slot is free, the next free slot in the VM's free list.
+       The VM finds the objects that are in use through its chunks
+       instead. */
+    struct sObject* next;
   };
 } Object;
 
-/* Our Virtual Machine */
+/* A header word and two fields. More per cache line means less memory for
+   sweep() and the copying collector to get through. */
+_Static_assert(sizeof(Object) >= 16 && sizeof(Object) <= 24, "Object has outgrown its header");
+
+Value intValue(int value) {
+  return ((Value)(intptr_t)value << 1) | 1;
+}
+
+int isInt(Value value) {
+  return (int)(value & 1);
+}
+
+int asInt(Value value) {
+  return (int)((intptr_t)value >> 1);
+}
+
+Value objectValue(Object* object) {
+  return (Value)object;
+}
+
+int isObject(Value value) {
+  return value != NIL_VALUE && !(value & 1);
+}
+
+Object* asObject(Value value) {
+  return (Object *)value;
+}
+
+int isPair(Value value) {
+  return isObject(value) && asObject(value)->type == OBJ_PAIR;
+}
+
+/* Where an object's Values are and how many of them there are: a pair's
+   head and tail, which sit side by side, an array's elements, or none at
+   all for a byte buffer. A weak reference only has its tail, the head
+   isn't ours to keep alive. */
+Value* objectFields(Object* object, size_t* count) {
+  if(object->type == OBJ_PAIR) {
+    *count = 2;
+    return &object->head;
+  }
+  if(object->type == OBJ_WEAK) {
+    *count = 1;
+    return &object->tail;
+  }
+  if(object->type == OBJ_ARRAY && object->large) {
+    *count = object->length;
+    return object->large->values;
+  }
+  *count = 0;
+  return NULL;
+}
+
+/* How many bytes an object takes up, its payload included. */
+long objectBytes(Object* object) {
+  long bytes = (long)sizeof(Object);
+  if((object->type == OBJ_ARRAY || object->type == OBJ_BYTES) && object->large) {
+    bytes += (long)object->large->size;
+  }
+  return bytes;
+}
+
+/* How many Objects fit in a chunk after the header. */
+#define OBJECTS_PER_CHUNK ((int)((CHUNK_SIZE - CHUNK_HEADER_SIZE) / sizeof(Object)))
+/* How many 64-bit words it takes to hold one bit per Object. */
+#define MARK_WORDS ((OBJECTS_PER_CHUNK + 63) / 64)
+
+/* Rather than asking malloc for every single Object we grab memory in big
+   chunks and slice them up into Object-sized slots. The VM keeps an array
+   of its chunks, which is also how sweep() finds every object.
+
+   Each chunk also carries a few bits for each of its slots. Keeping them
+   here rather than in the Objects themselves means a GC only writes to
+   these small bitmaps, so pages full of Objects stay shared with the parent
+   after a fork() instead of being copied the first time we collect. It also
+   means sweeping can mostly work on 64 objects at a time. */
+typedef struct sChunk {
+  /* Objects reached during the current GC. */
+  uint64_t marks[MARK_WORDS];
+  /* Slots holding an object rather than sitting in the free list. */
+  uint64_t live[MARK_WORDS];
+  /* Objects in the nursery. Everything is young until it's promoted,
+     unless it was pretenured. */
+  uint64_t young[MARK_WORDS];
+  /* Set when a sweep starts and cleared once it has got to this chunk, so
+     we know which chunks' mark bits still mean something. */
+  int needsSweep;
+  /* How many sweeps in a row have found this chunk empty. */
+  int emptyFor;
+  Object objects[OBJECTS_PER_CHUNK];
+} Chunk;
+
+_Static_assert(sizeof(Chunk) <= CHUNK_SIZE, "Chunk header is too big");
+_Static_assert((CHUNK_SIZE & (CHUNK_SIZE - 1)) == 0, "CHUNK_SIZE must be a power of two");
+
+/* The ways we know how to collect garbage. */
+typedef enum {
+  /* Mark everything reachable, then sweep the chunks. */
+  COLLECTOR_MARK_SWEEP,
+  /* Cheney-style semi-space copying: copy everything reachable into a fresh
+     space and throw the old one away. */
+  COLLECTOR_COPYING
+} CollectorType;
+
+/* What allocating, collecting, the barriers and the heap sizing do, which
+   is different for each kind of collector. Each of the collectorPolicies
+   has one of these named after it (see markSweepCollector and friends),
+   newVM() picks one going by the VMConfig, and the rest of the VM goes
+   through it rather than asking which collector it's got. A config no
+   policy matches gets the one for the setting that matters most to how
+   collections run: concurrent or incremental marking, then generations,
+   then the rest. They all keep the same GCStats, so there's nothing to
+   pick for that. newVM() setting the heap up and verifyHeap() checking
+   it still look at vm->collector, since they're about how the heap is
+   laid out, not about anything it does while running. The VM itself
+   comes further down. */
+struct sVM;
+
+typedef struct {
+  const char* name;
+  /* Make an object of the given type, collecting first if one is due. */
+  struct sObject* (*allocate)(struct sVM* vm, ObjectType type);
+  /* newObjects(): make n of them at once, linked through their tails. */
+  struct sObject* (*allocateMany)(struct sVM* vm, ObjectType type, int n);
+  /* Collect first if the large object space has grown enough to call for
+     it, before newLarge() adds to it, or NULL if allocate() already keeps
+     an eye on it. */
+  void (*reserveLarge)(struct sVM* vm);
+  /* What allocate() and allocateMany() do before they make count objects:
+     a bit more of any collection that's under way, as much as count
+     separate allocations would have done, and starting one if it's due.
+     NULL if allocate() and allocateMany() see to that themselves. */
+  void (*collectIfNeeded)(struct sVM* vm, int count);
+  /* A full collection, once any marking that was under way is done. */
+  void (*collect)(struct sVM* vm);
+  /* Finish off a collection that's part way through marking. Only called
+     while one is, so NULL if this collector never leaves one that way. */
+  void (*completeMarking)(struct sVM* vm);
+  /* What every store into an object calls first, or NULL if this
+     collector doesn't need to hear about them. Incremental and concurrent
+     marking put a barrier of their own in front of this while they're
+     marking. */
+  void (*writeBarrier)(struct sVM* vm, struct sObject* object, Value old, Value value);
+  /* What weakTarget() and pushCleared() call with what they're handing the
+     program while a collection's marking, since it could have come from
+     somewhere marking's been through already. NULL along with
+     completeMarking. */
+  void (*readBarrier)(struct sVM* vm, Value value);
+  /* What pop() calls with what comes off the stack while a collection's
+     marking, or NULL if marking doesn't need to hear about it. */
+  void (*stackBarrier)(struct sVM* vm, Value value);
+  /* How many bytes it takes to trigger a collection, full or minor. */
+  long (*threshold)(struct sVM* vm, int full);
+  /* How much memory the objects' home takes up, empty or not. */
+  long (*footprint)(struct sVM* vm);
+  /* How many more bytes of it count more objects would need. */
+  long (*growth)(struct sVM* vm, int count);
+} Collector;
+
+/* What the operations that can fail, like push(), return. */
+typedef enum {
+  VM_OK,
+  /* The stack already holds stackLimit objects. */
+  VM_STACK_OVERFLOW,
+  /* A snapshot file couldn't be read or written. */
+  VM_IO_ERROR,
+  /* A snapshot file isn't one we know how to load. */
+  VM_BAD_SNAPSHOT,
+  /* A program run by vmRun() wanted more off the stack than was there. */
+  VM_STACK_UNDERFLOW,
+  /* A program run by vmRun() wanted a pair and got an int, or the other
+     way round, or vmSaveSnapshot() found something other than pairs. */
+  VM_TYPE_ERROR
+} VMStatus;
+
+/* Knobs for newVM(). Use defaultConfig() and change what you care about. */
+typedef struct {
+  /* Which collector to use. */
+  CollectorType collector;
+
+  /* How many objects to make room for before going back to malloc. For the
+     copying collector this is the size of each semi-space. */
+  int initialCapacity;
+
+  /* The most objects the stack can hold. Pushing any more gets you
+     VM_STACK_OVERFLOW. */
+  int stackLimit;
+
+  /* When to collect. After a full collection the next one is due once the
+     heap has grown to heapGrowth times what survived, but never before it
+     reaches minHeapBytes, and never later than maxHeapBytes (0 means there's
+     no limit). Once the live objects alone fill maxHeapBytes every
+     allocation collects, so pick it with some room to spare. The copying
+     collector goes by how full its semi-space is instead. */
+  long minHeapBytes;
+  long maxHeapBytes;
+  double heapGrowth;
+  /* A hard limit on how much memory the heap can take up, chunks, large
+     object space and all, or 0 for none. Rather than go over it an
+     allocation does a full collection, and if that doesn't make room the
+     program is out of memory. For the copying collector this counts one
+     semi-space, though while it's collecting there are two. */
+  long heapLimitBytes;
+  /* How many sweeps in a row a chunk has to be found empty before we give
+     it back to the operating system, or -1 to hang on to every chunk. */
+  int releaseDelay;
+  /* Rather than sticking with heapGrowth, adjust it after every full
+     collection so the time spent collecting stays at about gcTimeRatio
+     times the time spent running the program. Bigger live sets then get
+     proportionally bigger heaps instead of proportionally more GC. */
+  int adaptive;
+  double gcTimeRatio;
+
+  /* Most objects die young, so instead of marking and sweeping everything
+     every time we can keep new objects in a nursery and collect just that.
+     Objects that survive promotionAge minor collections get promoted to the
+     old generation, which is only collected when the threshold above says
+     so, going by the old generation's size. */
+  int generational;
+  /* How many new objects we allocate between minor collections. */
+  int nurserySize;
+  /* How many minor collections an object has to survive to be promoted. */
+  int promotionAge;
+  /* Keep count, for each site named with vmSetSite(), of how many of its
+     objects live long enough to be promoted, and once nearly all of them
+     do, have its objects born in the old generation instead. Then minor
+     collections don't have to keep marking them and sweeping them until
+     they get promoted anyway. */
+  int pretenure;
+
+  /* Rather than sweeping everything in one go at the end of a collection,
+     sweep sweepBatch objects each time newObject() is called until we're
+     done. A GC pause is then just the time it takes to mark. */
+  int lazySweep;
+  int sweepBatch;
+
+  /* Rather than marking everything in one pause, mark a little at a time:
+     once a collection is due, every newObject() works through markRate gray
+     objects until marking is done. You can also drive it yourself with
+     gcStep(). This doesn't combine with generational mode. */
+  int incremental;
+  int markRate;
+
+  /* How many threads to collect with. With more than one, marking threads
+     each take a share of the roots and steal work from each other when they
+     run out, and sweeping threads each sweep their own chunks. Incremental
+     marking and lazy sweeping are always done on a single thread. */
+  int gcThreads;
+
+  /* Rather than marking in a pause, or a little at a time, mark on a
+     thread of its own while the program carries on. Once a collection is
+     due newObject() sets the marker going, and once it's run out of work
+     there's one short pause to finish up. Turn on lazySweep as well to
+     keep sweeping out of the pauses too. This doesn't combine with
+     generational mode or incremental marking, and the program has to
+     pop() the stack rather than lowering stackSize itself, or the marker
+     won't hear about it. */
+  int concurrent;
+
+  /* Sample one in every sampleRate allocations, noting where in the
+     program it came from, and after each collection how many bytes of the
+     sampled objects from each place are still alive, so you can see what
+     keeps the collector busy. 0 turns it off. See vmSetSite() and
+     printAllocationSites(). */
+  int sampleRate;
+} VMConfig;
+
+/* The combinations of collector settings we know by name, so a program
+   can pick one with useCollectorPolicy(), or whoever runs it can with the
+   BABYVM_COLLECTOR environment variable, without recompiling. The
+   benchmarks try every one of these. */
+typedef struct {
+  const char* name;
+  CollectorType collector;
+  int generational;
+  int pretenure;
+  int lazySweep;
+  int incremental;
+  int concurrent;
+  int adaptive;
+  int gcThreads;
+} CollectorPolicy;
+
+CollectorPolicy collectorPolicies[] = {
+  /* name            collector             gen pre lazy inc conc adapt threads */
+  { "mark-sweep",    COLLECTOR_MARK_SWEEP, 0,  0,  0,   0,  0,   0,    1 },
+  { "lazy-sweep",    COLLECTOR_MARK_SWEEP, 0,  0,  1,   0,  0,   0,    1 },
+  { "incremental",   COLLECTOR_MARK_SWEEP, 0,  0,  0,   1,  0,   0,    1 },
+  { "generational",  COLLECTOR_MARK_SWEEP, 1,  0,  0,   0,  0,   0,    1 },
+  { "pretenuring",   COLLECTOR_MARK_SWEEP, 1,  1,  0,   0,  0,   0,    1 },
+  { "parallel",      COLLECTOR_MARK_SWEEP, 0,  0,  0,   0,  0,   0,    4 },
+  { "adaptive",      COLLECTOR_MARK_SWEEP, 0,  0,  0,   0,  0,   1,    1 },
+  { "copying",       COLLECTOR_COPYING,    0,  0,  0,   0,  0,   0,    1 },
+  { "concurrent",    COLLECTOR_MARK_SWEEP, 0,  0,  1,   0,  1,   0,    1 }
+};
+
+#define NUM_COLLECTOR_POLICIES ((int)(sizeof(collectorPolicies) / sizeof(collectorPolicies[0])))
+
+/* Set up config's collector the way the policy called name does, leaving
+   the rest of it alone. Returns 0 if there's no policy by that name. */
+int useCollectorPolicy(VMConfig* config, const char* name) {
+  for(int i = 0; i < NUM_COLLECTOR_POLICIES; i++) {
+    CollectorPolicy* policy = &collectorPolicies[i];
+    if(strcmp(policy->name, name) != 0) continue;
+    config->collector = policy->collector;
+    config->generational = policy->generational;
+    config->pretenure = policy->pretenure;
+    config->lazySweep = policy->lazySweep;
+    config->incremental = policy->incremental;
+    config->concurrent = policy->concurrent;
+    config->adaptive = policy->adaptive;
+    config->gcThreads = policy->gcThreads;
+    return 1;
+  }
+  return 0;
+}
+
+/* The defaults, with whichever collector policy BABYVM_COLLECTOR names, if
+   it's set. Naming one that doesn't exist prints the ones that do and
+   exits. */
+VMConfig defaultConfig() {
+  VMConfig config;
+  config.collector = COLLECTOR_MARK_SWEEP;
+  config.initialCapacity = 0;
+  config.stackLimit = 1024 * 1024;
+  config.minHeapBytes = 256 * 1024;
+  config.maxHeapBytes = 0;
+  config.heapGrowth = 2.0;
+  config.heapLimitBytes = 0;
+  config.releaseDelay = 2;
+  config.adaptive = 0;
+  config.gcTimeRatio = 0.1;
+  config.generational = 0;
+  config.nurserySize = 1024;
+  config.promotionAge = 2;
+  config.pretenure = 0;
+  config.lazySweep = 0;
+  config.sweepBatch = 64;
+  config.incremental = 0;
+  config.markRate = 8;
+  config.gcThreads = 1;
+  config.concurrent = 0;
+  config.sampleRate = 0;
+
+  const char* policy = getenv("BABYVM_COLLECTOR");
+  if(policy != NULL && *policy != '\0') {
+    /* This comes from whoever's running the program rather than from the
+       program, so a typo gets told off and stops us, even under NDEBUG,
+       instead of quietly running the default collector. */
+    if(!useCollectorPolicy(&config, policy)) {
+      fprintf(stderr, "BABYVM_COLLECTOR: no collector policy called \"%s\". Try one of:", policy);
+      for(int i = 0; i < NUM_COLLECTOR_POLICIES; i++) {
+        fprintf(stderr, " %s", collectorPolicies[i].name);
+      }
+      fprintf(stderr, "\n");
+      exit(1);
+    }
+  }
+  return config;
+}
+
+/* What happened in one collection. For the copying collector "marking" is
+   the copying, and there's no sweeping. */
+typedef struct {
+  /* Whether it was a full collection or just the nursery. */
+  int full;
+  /* How long marking and sweeping took in all, even if they were spread
+     out over lots of little pauses. */
+  long markNanos;
+  long sweepNanos;
+  int marked;
+  int swept;
+  int freed;
+  long bytesFreed;
+  /* How many bytes it took to trigger a collection like this one, before
+     and after: of the whole heap for a plain mark-sweep VM, of the old
+     generation for a full generational collection, of the nursery for a
+     minor one and of the semi-space for the copying collector. */
+  long thresholdBefore;
+  long thresholdAfter;
+} GCCycle;
+
+/* Everything the VM keeps track of about its collections, from vmGetStats().
+   None of it costs more than a clock read and a few additions per pause. */
+typedef struct {
+  /* The last collection that finished. */
+  GCCycle last;
+
+  long collections;
+  long minorCollections;
+  long totalMarked;
+  long totalMarkNanos;
+  long totalSweepNanos;
+  long totalFreed;
+  long totalBytesFreed;
+
+  /* Every time the GC stops the program: each call to gc() or minorGC(),
+     each slice of incremental marking and each bit of lazy sweeping. A
+     pause of n nanoseconds goes in pauseHistogram[pauseBucket(n)]. */
+  long pauses;
+  long totalPauseNanos;
+  long maxPauseNanos;
+  long pauseHistogram[PAUSE_BUCKETS];
+} GCStats;
+
+/* What a sweep has turned up so far. Parallel sweeping gives each thread its
+   own so they never have to touch anything shared until they're done. */
+typedef struct {
+  /* The slots freed, in address order. */
+  Object* freeHead;
+  Object* freeTail;
+  /* How many objects were looked at, and how many freed. */
+  int swept;
+  int freed;
+  /* How many young objects went away, either freed or promoted. */
+  int youngGone;
+  /* Pairs that were promoted, which might need remembering. With
+     pretenuring on this has everything else that was promoted too, so
+     pretenuring can count it. */
+  Object** promoted;
+  int promotedCount;
+  int promotedCapacity;
+} SweepState;
+
+/* The next few gray objects marking is going to trace, oldest first. Each
+   one is prefetched as it goes in, so by the time it comes out its fields
+   have had MARK_PREFETCH objects' worth of tracing to arrive from memory. */
+typedef struct {
+  Object* objects[MARK_PREFETCH];
+  int first;
+  int count;
+} PrefetchWindow;
+
+/* The growable circular buffer behind a Deque. When it fills up we switch to
+   one twice the size, but keep the old one around until marking is over in
+   case a thread stealing from us is still reading it. */
+typedef struct sDequeArray {
+  long size;
+  struct sDequeArray* previous;
+  _Atomic(Object*) items[];
+} DequeArray;
+
+/* A Chase-Lev work-stealing deque. The thread that owns it pushes and takes
+   from the bottom without any locking, and the others steal from the top,
+   only needing a compare-and-swap when they race for the last item. */
 typedef struct {
-  /* The stack */
-  Object* stack[STACK_MAX];
+  atomic_long top;
+  atomic_long bottom;
+  _Atomic(DequeArray*) array;
+} Deque;
+
+/* One of the threads that helps with collection. Worker 0 is whichever
+   thread called into the GC, the rest sit in the VM's pool waiting for
+   something to do. */
+typedef struct {
+  struct sVM* vm;
+  int id;
+  pthread_t thread;
+  /* The gray objects this worker is going to get around to. */
+  Deque deque;
+  /* How many objects this worker has marked. */
+  int numMarked;
+  /* What this worker has swept. */
+  SweepState sweep;
+  /* For picking who to steal from. */
+  unsigned int seed;
+} GCWorker;
+
+/* The front of a snapshot file: everything vmSaveSnapshot() found
+   reachable from the stack, written out so vmLoadSnapshot() can map it
+   straight back in. After this header come the roots, the Values that were
+   on the stack, and then at objectsOffset the objects themselves, laid out
+   just like they are in memory except that a pointer to an object is
+   stored as that object's offset in the file. */
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t objectSize;
+  uint64_t numRoots;
+  uint64_t numObjects;
+  uint64_t objectsOffset;
+} SnapshotHeader;
+
+/* A snapshot file mapped in as a read-only old space. Its pages start out
+   inaccessible, and the first time one is touched snapshotFault() turns
+   the offsets on it into real pointers and makes it readable. That way
+   loading costs the same however big the snapshot is, and the parts that
+   never get looked at never even get read from disk. Nothing in a
+   snapshot is ever swept or moved, or written to.
+
+   vmFreeze() makes these too, out of memory of its own rather than a file.
+   Those are relocated from the start, so relocated is NULL and fd is -1,
+   and they aren't in mappedSnapshots, since there's nothing for
+   snapshotFault() to do about them. */
+typedef enum {
+  PAGE_UNTOUCHED,
+  /* Some thread has claimed it and is relocating it. */
+  PAGE_RELOCATING,
+  PAGE_RELOCATED
+} PageState;
+
+typedef struct {
+  /* The whole file, mapped. */
+  char* base;
+  size_t length;
+  /* The file itself, to read pages from while they're being relocated. */
+  int fd;
+  /* Where its objects are. */
+  Object* objects;
+  Object* objectsEnd;
+  /* How far each page of the objects has got, a PageState. */
+  _Atomic(unsigned char)* relocated;
+} Snapshot;
+
+/* Somewhere in the program that allocates, as named by vmSetSite(), and
+   what the allocation sampler has seen come from there. */
+typedef struct {
+  const char* name;
+  /* How many allocations we sampled here. */
+  long sampled;
+  /* How many bytes of the ones we sampled survived the last collection,
+     times the sample rate, so roughly how much of the heap is from here. */
+  long survivingBytes;
+  /* For pretenuring: how many objects from here were born young lately,
+     and how many of those have been promoted. Both get halved every time
+     we decide about the site, so old history fades. */
+  long young;
+  long promoted;
+  /* Whether objects from here are born old, and how many until the next
+     one that's born young anyway. */
+  int pretenured;
+  int probeCountdown;
+} AllocationSite;
+
+/* An object the allocation sampler is keeping an eye on. */
+typedef struct {
+  Object* object;
+  int site;
+} Sample;
+
+/* Our Virtual Machine */
+typedef struct sVM {
+  /* The stack. It's all one reservation, so growing it never moves what's
+     already there and marking the roots is still just a walk along an
+     array. */
+  Value* stack;
   
   // The current size of the stack.
   int stackSize;
+  /* How many entries have memory behind them, and how many ever can. */
+  int stackCommitted;
+  int stackLimit;
   /* The total number of currently allocated objects. */
   int numObjects;
-  /* The number of objects required to trigger a GC. */
-  int maxObjects;
+  /* The large object space: the payloads of every array and byte buffer,
+     and how many bytes they take up between them. */
+  LargeObject* largeObjects;
+  long largeBytes;
+  /* Every weak reference whose target might still be collected, so the end
+     of marking can deal with them without looking at the rest of the
+     heap. */
+  Object** weakRefs;
+  int weakCount;
+  int weakCapacity;
+  /* What the weak references whose targets are gone wanted handed back,
+     oldest first from clearedNext, waiting for pushCleared(). Everything
+     in here is a root. */
+  Value* cleared;
+  int clearedNext;
+  int clearedCount;
+  int clearedCapacity;
+  /* How many bytes of objects trigger the next full GC, counting just the
+     old generation if we're generational. For the copying collector,
+     which collects whenever its space fills up, this is how far the large
+     object space can grow before we collect anyway. */
+  long maxBytes;
+  /* The heuristic's settings, copied from the VMConfig. heapGrowth moves
+     around if adaptive is set. */
+  long minHeapBytes;
+  long maxHeapBytes;
+  double heapGrowth;
+  int adaptive;
+  /* The limits on the heap's memory, copied from the VMConfig. */
+  long heapLimitBytes;
+  int releaseDelay;
+  double gcTimeRatio;
+  /* When the adaptive heuristic last looked, and how much time had been
+     spent collecting by then. */
+  long adaptStart;
+  long adaptGCNanos;
+
+  /* Which collector we're using, and what it does. barrier is the write
+     barrier stores go through right now, which is the collector's own
+     unless marking's under way, or NULL if there's nothing to do. */
+  CollectorType collector;
+  const Collector* ops;
+  void (*barrier)(struct sVM* vm, Object* object, Value old, Value value);
 
-  /* The first object in the list of objects we've allocated, as described
-     in the Object's definition above. */
-  Object* firstObject;
+  /* The copying collector doesn't use chunks or the bookkeeping below.
+     Objects are bump-allocated out of fromSpace, and a GC copies the live
+     ones into a new to-space which then takes its place. */
+  Object* fromSpace;
+  /* How many objects fit in each semi-space. */
+  int spaceCapacity;
+  /* Index of the next free slot in fromSpace. */
+  int spaceUsed;
+
+  /* The number of objects in the nursery. If we're not generational that's
+     all of them, since nothing ever gets promoted. */
+  int numYoung;
+
+  /* The generational collector's settings, copied from the VMConfig. */
+  int generational;
+  int nurserySize;
+  int promotionAge;
+  int pretenure;
+  /* Set while a minor collection is marking, so mark() leaves old objects
+     alone. */
+  int collectingYoung;
+  /* Old pairs that might point at young objects. A minor collection treats
+     their fields as roots so it never has to look at the rest of the old
+     generation. setHead() and setTail() add to this. */
+  Object** remembered;
+  int rememberedCount;
+  int rememberedCapacity;
+
+  /* Lazy sweeping settings, copied from the VMConfig. */
+  int lazySweep;
+  int sweepBatch;
+  /* Set from the end of marking until every object has been swept. */
+  int sweeping;
+  /* Whether the sweep under way is for a full collection or a minor one. */
+  int sweepingFull;
+  /* The index of the next chunk to sweep. */
+  int sweepCursor;
+  /* What the current sweep has turned up so far. */
+  SweepState sweepState;
+
+  /* Incremental marking's setting, copied from the VMConfig. */
+  int markRate;
+  /* Set from the start of an incremental collection until the gray stack
+     runs dry. While it's set setHead() and setTail() have extra work to do,
+     and new objects are born marked. */
+  int marking;
+
+  /* Concurrent marking's setting, copied from the VMConfig. While a
+     concurrent collection is marking, all of the marking happens on the
+     marker thread, and the barriers put what they shade in satbBuffer
+     instead of marking it. A full buffer goes on satbQueue for the marker,
+     which takes whatever's there whenever it's woken up. */
+  int concurrent;
+  pthread_t marker;
+  pthread_mutex_t markerLock;
+  pthread_cond_t markerWake;
+  pthread_cond_t markerDone;
+  int markerShutdown;
+  /* Set when the marker should go through the stack. */
+  int markerScanStack;
+  /* Set once the marker's scanned the stack and the queue's empty, so
+     there's nothing more it can do without us. newObject() keeps an eye on
+     this without taking the lock. */
+  atomic_int markerIdle;
+  Object** satbQueue;
+  int satbQueueCount;
+  int satbQueueCapacity;
+  Object** satbBuffer;
+  int satbBufferCount;
+  /* The marker's own gray stack, and how much it's marked this collection
+     and how long it's taken. */
+  Object** markerGray;
+  int markerGrayCount;
+  int markerGrayCapacity;
+  int markerMarked;
+  long markerNanos;
+
+  /* The threads we collect with, gcThreads of them. When there's a job for
+     them poolJob is set and poolGeneration goes up, and the pool threads
+     each run it while the calling thread runs it as worker 0. */
+  int gcThreads;
+  GCWorker* workers;
+  pthread_mutex_t poolLock;
+  pthread_cond_t poolWake;
+  pthread_cond_t poolDone;
+  void (*poolJob)(struct sVM* vm, int worker);
+  long poolGeneration;
+  int poolBusy;
+  int poolShutdown;
+  /* How many marking threads have run out of work, so we can tell when
+     they're all done. */
+  atomic_int idleWorkers;
+
+  /* The chunks our Objects live in, sorted by address, so that sweeping
+     them in order walks memory in order. */
+  Chunk** chunks;
+  int numChunks;
+  int chunksCapacity;
+  /* Slots that aren't holding a live Object, linked together through their
+     next field. newObject() takes from the front and sweep() adds to the
+     end, in address order. freeListTail is only any use while freeList
+     isn't NULL. */
+  Object* freeList;
+  Object* freeListTail;
+  /* What's left of the newest chunk, which newObject() carves objects off
+     the front of once the free list is empty. Bumping a pointer beats
+     writing a free list through the whole chunk first, and it's all ours,
+     so there's nothing atomic about it. */
+  Object* bump;
+  Object* bumpEnd;
+
+  /* The intern table: every pair pushInterned() has made, hashed by what's
+     in it, kept at most half full. Interned pairs live in chunks of their
+     own, which are never swept, and they're born marked and never
+     unmarked, so no collection frees them or even looks inside them. */
+  Object** interned;
+  size_t internedCount;
+  size_t internedCapacity;
+  Chunk** internChunks;
+  int numInternChunks;
+  Object* internBump;
+  Object* internBumpEnd;
+
+  /* Objects we've marked but whose fields we haven't looked at yet, the
+     "gray" objects. Marking works through this instead of recursing, so a
+     long list of pairs can't blow up the C stack. It grows as needed and
+     sticks around between GCs. */
+  Object** grayStack;
+  int grayCount;
+  int grayCapacity;
+
+  /* How many objects the last GC marked and how long it took, so we can
+     keep an eye on marking throughput. */
+  int numMarked;
+  long markNanos;
+
+  /* What we know about the collections so far, and the one under way. */
+  GCStats stats;
+  GCCycle cycle;
+  /* How deep we are in GC functions that pause the program, and when the
+     outermost one started, so a gc() that finishes off a lazy sweep only
+     counts as one pause. */
+  int pauseDepth;
+  long pauseStart;
+
+  /* The allocation sampler. sampleCountdown is how many allocations until
+     the next sample, and currentSite is where vmSetSite() said we are, or
+     -1 if it hasn't yet. */
+  int sampleRate;
+  int sampleCountdown;
+  AllocationSite* sites;
+  int numSites;
+  int sitesCapacity;
+  int currentSite;
+  /* The sampled objects that were alive at the last collection, or have
+     been allocated since. */
+  Sample* samples;
+  int numSamples;
+  int samplesCapacity;
+
+  /* The snapshots vmLoadSnapshot() has mapped in, and the regions
+     vmFreeze() has sealed. */
+  Snapshot** snapshots;
+  int numSnapshots;
 } VM;
 
-VM* newVM() {
-  VM* vm = (VM *)malloc(sizeof(VM));
-  vm->stackSize = 0;
-  return vm;
+/* Find the chunk an Object lives in. Chunks are aligned to CHUNK_SIZE so
+   this is just a matter of masking off the low bits of its address. */
+Chunk* chunkFor(Object* object) {
+  return (Chunk *)((uintptr_t)object & ~(uintptr_t)(CHUNK_SIZE - 1));
 }
 
-void mark(Object* object) {
-  
-  /* Return if we've already marked this one. This prevents cycles and thereby
-     explosions due to running forever. */
-  if(object->marked) return;
+/* Has this object been reached during the current GC? */
+int isMarked(Object* object) {
+  Chunk* chunk = chunkFor(object);
+  int index = (int)(object - chunk->objects);
+  return (chunk->marks[index / 64] >> (index % 64)) & 1;
+}
 
-  /* Mark the object as reachable. */
-  object->marked = 1;
+void setMarked(Object* object) {
+  Chunk* chunk = chunkFor(object);
+  int index = (int)(object - chunk->objects);
+  chunk->marks[index / 64] |= (uint64_t)1 << (index % 64);
+}
 
-  /* If the object is a pair, its two fields are reachable too. */
-  if(object->type == OBJ_PAIR) {
-    mark(object->head);
-    mark(object->tail);
-  }
+/* Like setMarked(), but safe when other threads are marking too. Returns
+   whether we were the ones to mark it. */
+int tryMark(Object* object) {
+  Chunk* chunk = chunkFor(object);
+  int index = (int)(object - chunk->objects);
+  uint64_t bit = (uint64_t)1 << (index % 64);
+  uint64_t* word = &chunk->marks[index / 64];
+  /* A plain read first, so we don't fight over the cache line for objects
+     that are already marked. */
+  if(__atomic_load_n(word, __ATOMIC_RELAXED) & bit) return 0;
+  return !(__atomic_fetch_or(word, bit, __ATOMIC_RELAXED) & bit);
 }
 
-/* To mark all of the reachable objects, we start with the variables that are
-   in memory, so that means walking the stack. Using mark() this will
-   mark every object in memory that is reachable. */
-void markAll(VM* vm) {
-  printf("\tMarking %d objects\n", vm->stackSize);
-  for(int i = 0; i < vm->stackSize; i++) {
-    mark(vm->stack[i]);
+void initWindow(PrefetchWindow* window) {
+  window->first = 0;
+  window->count = 0;
+}
+
+int windowIsFull(PrefetchWindow* window) {
+  return window->count == MARK_PREFETCH;
+}
+
+void windowPush(PrefetchWindow* window, Object* object) {
+  __builtin_prefetch(object);
+  window->objects[(window->first + window->count++) % MARK_PREFETCH] = object;
+}
+
+/* Take the oldest object out of the window, or NULL if it's empty. */
+Object* windowTake(PrefetchWindow* window) {
+  if(window->count == 0) return NULL;
+  Object* object = window->objects[window->first];
+  window->first = (window->first + 1) % MARK_PREFETCH;
+  window->count--;
+  return object;
+}
+
+/* Empty chunks that any VM in the process can have, so one VM finishing
+   with its chunks saves the next one going to malloc for them. A chunk in
+   here has no objects in it, so they're linked through their first slot.
+   Taking a chunk is the only time allocation takes a lock, and that's once
+   every OBJECTS_PER_CHUNK objects at most. */
+pthread_mutex_t chunkPoolLock = PTHREAD_MUTEX_INITIALIZER;
+Chunk* chunkPool = NULL;
+int chunkPoolSize = 0;
+
+/* Map a new chunk. mmap only promises page alignment, so we map twice as
+   much as we need and trim it down to a chunk that's aligned to its size. */
+Chunk* mapChunk() {
+  char* start = (char *)mmap(NULL, 2 * CHUNK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  assert(start != MAP_FAILED); // Out of memory
+  char* chunk = (char *)(((uintptr_t)start + CHUNK_SIZE - 1) & ~(uintptr_t)(CHUNK_SIZE - 1));
+  if(chunk > start) munmap(start, (size_t)(chunk - start));
+  munmap(chunk + CHUNK_SIZE, (size_t)(start + CHUNK_SIZE - chunk));
+  return (Chunk *)chunk;
+}
+
+/* Get an empty chunk, from the shared pool if it has one. */
+Chunk* takeChunk() {
+  pthread_mutex_lock(&chunkPoolLock);
+  Chunk* chunk = chunkPool;
+  if(chunk) {
+    chunkPool = (Chunk *)chunk->objects[0].next;
+    chunkPoolSize--;
   }
+  pthread_mutex_unlock(&chunkPoolLock);
+
+  if(chunk == NULL) chunk = mapChunk();
+  return chunk;
 }
 
-/* Traverse the list of allocated objects and free any of them that
-   aren't marked. */
-void sweep(VM* vm) {
-  Object** object = &vm->firstObject;
-  int swept = 0;
-  int freed = 0;
-  while(*object) {
-    if(!(*object)->marked) {
-      /* This object wasn't reached, so remove it from the list and free it. */
-      Object* unreached = *object;
-
-      *object = unreached->next;
-      free(unreached);
-      /* Increment the number we've freed. */
-      freed++;
-      /* Decrement the count of objects */
-      vm->numObjects--;
-    } else {
-      /* This object was reached, so unmark it (for the next GC) and move on
-         to the next. */
-      (*object)->marked = 0;
-      object = &(*object)->next;
-    }
-    /* Increment the number we've swept. */
-    swept++;
+/* Put a chunk we're done with in the shared pool, unless it's full, in
+   which case it's unmapped. Either way its memory goes back to the
+   operating system: a pooled chunk keeps just its first page, which is
+   where the link to the next one is, and the rest reads as zeroes again
+   once it's used. */
+void giveChunk(Chunk* chunk) {
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  if(CHUNK_HEADER_SIZE + sizeof(Object) <= page && page < CHUNK_SIZE) {
+    madvise((char *)chunk + page, CHUNK_SIZE - page, MADV_DONTNEED);
+  }
+  pthread_mutex_lock(&chunkPoolLock);
+  if(chunkPoolSize < CHUNK_POOL_MAX) {
+    chunk->objects[0].next = (Object *)chunkPool;
+    chunkPool = chunk;
+    chunkPoolSize++;
+    chunk = NULL;
   }
-  printf("\tSwept %d objects, freed %d.\n", swept, freed);
+  pthread_mutex_unlock(&chunkPoolLock);
+  if(chunk) munmap(chunk, CHUNK_SIZE);
 }
 
-/* Perform a garbage collection. */
-void gc(VM* vm) {
-  printf("\nEntering GC\n");
-  int numObjects = vm->numObjects;
+/* fork() only brings along the thread that called it, so if another thread
+   had chunkPoolLock just then, the child's copy would stay locked for
+   good. Holding the lock ourselves across every fork keeps the pool in one
+   piece on both sides, and the child gets a fresh lock. newVM() puts
+   these in place. */
+void lockChunkPool() {
+  pthread_mutex_lock(&chunkPoolLock);
+}
 
-  /* Mark… */
-  markAll(vm);
-  /* Sweep! */
-  sweep(vm);
+void unlockChunkPool() {
+  pthread_mutex_unlock(&chunkPoolLock);
+}
 
-  /* Change the threshold for the next collection to 2 times the new
-     number of objects. */
-  vm->maxObjects = vm->numObjects * 2;
-  printf("GC completed, Total objects now %d. Threshold is %d.\n\n", vm->numObjects, vm->maxObjects);
+void resetChunkPool() {
+  pthread_mutex_init(&chunkPoolLock, NULL);
 }
 
-/* Function for adding an object from the stack. */
-void push(VM* vm, Object* value) {
-  assert(vm->stackSize < STACK_MAX); // Stack overflow
-  vm->stack[vm->stackSize++] = value;
-  printf("Adding object to stack, size is now %d.\n", vm->stackSize);
+pthread_once_t chunkPoolForkOnce = PTHREAD_ONCE_INIT;
+
+void installChunkPoolFork() {
+  int result = pthread_atfork(lockChunkPool, unlockChunkPool, resetChunkPool);
+  assert(result == 0); // Out of memory
+  (void)result;
 }
 
-/* Function for removing an object from the stack. */
-Object* pop(VM* vm) {
-  assert(vm->stackSize > 0); // Stack underflow
-  return vm->stack[--vm->stackSize];
+/* Get another chunk and start bump allocating from it. Whatever's left of
+   the last one goes on the free list so it doesn't go to waste. */
+void growPool(VM* vm) {
+  if(vm->bump < vm->bumpEnd && vm->freeList == NULL) vm->freeListTail = vm->bumpEnd - 1;
+  for(long i = vm->bumpEnd - vm->bump - 1; i >= 0; i--) {
+    vm->bump[i].next = vm->freeList;
+    vm->freeList = &vm->bump[i];
+  }
+
+  Chunk* chunk = takeChunk();
+  memset(chunk->marks, 0, sizeof(chunk->marks));
+  memset(chunk->live, 0, sizeof(chunk->live));
+  memset(chunk->young, 0, sizeof(chunk->young));
+  chunk->needsSweep = 0;
+  chunk->emptyFor = 0;
+
+  if(vm->numChunks == vm->chunksCapacity) {
+    vm->chunksCapacity = vm->chunksCapacity ? vm->chunksCapacity * 2 : CHUNKS_INITIAL;
+    vm->chunks = (Chunk **)realloc(vm->chunks, sizeof(Chunk*) * vm->chunksCapacity);
+    assert(vm->chunks != NULL); // Out of memory
+  }
+  /* Keep them in address order. A chunk that goes in below the sweep
+     cursor pushes the ones that are still to be swept along one. */
+  int index = vm->numChunks;
+  while(index > 0 && vm->chunks[index - 1] > chunk) index--;
+  memmove(&vm->chunks[index + 1], &vm->chunks[index], sizeof(Chunk*) * (size_t)(vm->numChunks - index));
+  vm->chunks[index] = chunk;
+  vm->numChunks++;
+  if(index < vm->sweepCursor) vm->sweepCursor++;
+
+  vm->bump = chunk->objects;
+  vm->bumpEnd = chunk->objects + OBJECTS_PER_CHUNK;
+  TRACE(1, "Grew object pool to %d chunks.\n", vm->numChunks);
 }
 
-/* Function for allocating a new object into the stack. */
-Object* newObject(VM* vm, ObjectType type) {
+DequeArray* newDequeArray(long size) {
+  DequeArray* array = (DequeArray *)malloc(sizeof(DequeArray) + sizeof(Object*) * size);
+  assert(array != NULL); // Out of memory
+  array->size = size;
+  array->previous = NULL;
+  return array;
+}
 
-  /* If the number of objects in the stack is equal to the max objects
-     threshold, run the garbage collector. */
-  printf("Checking for GC: %d objects in stack == %d max objects\n", vm->numObjects, vm->maxObjects);
-  if(vm->numObjects == vm->maxObjects) {
-    printf("GC needed\n");
-    gc(vm);
-  } else {
-    printf("GC not needed\n");
+void initDeque(Deque* deque) {
+  atomic_init(&deque->top, 0);
+  atomic_init(&deque->bottom, 0);
+  atomic_init(&deque->array, newDequeArray(DEQUE_INITIAL));
+}
+
+/* Push onto the bottom. Only the owning thread may call this. */
+void dequePush(Deque* deque, Object* object) {
+  long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+  long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+  DequeArray* array = atomic_load_explicit(&deque->array, memory_order_relaxed);
+
+  if(bottom - top > array->size - 1) {
+    /* Full, so copy everything into an array twice the size. */
+    DequeArray* bigger = newDequeArray(array->size * 2);
+    for(long i = top; i < bottom; i++) {
+      atomic_store_explicit(&bigger->items[i & (bigger->size - 1)],
+        atomic_load_explicit(&array->items[i & (array->size - 1)], memory_order_relaxed),
+        memory_order_relaxed);
+    }
+    bigger->previous = array;
+    atomic_store_explicit(&deque->array, bigger, memory_order_release);
+    array = bigger;
   }
 
-  /* Allocate the new object */
-  Object* object = malloc(sizeof(Object));
-  /* Set it's type. */
-  object->type = type;
-  /* Init marked to zero. */
-  object->marked = 0;
+  atomic_store_explicit(&array->items[bottom & (array->size - 1)], object, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+}
 
-  /* Insert it to the list of allocated objects. */
-  object->next = vm->firstObject;
-  vm->firstObject = object;
+/* Take from the bottom, or NULL if it's empty. Only the owning thread may
+   call this. */
+Object* dequeTake(Deque* deque) {
+  long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+  DequeArray* array = atomic_load_explicit(&deque->array, memory_order_relaxed);
+  atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+  long top = atomic_load_explicit(&deque->top, memory_order_relaxed);
 
-  /* Increment the object count */
-  vm->numObjects++;
-  printf("Created object, number of objects is now %d\n", vm->numObjects);
-  /* Return the object back to our caller. */
+  Object* object = NULL;
+  if(top <= bottom) {
+    object = atomic_load_explicit(&array->items[bottom & (array->size - 1)], memory_order_relaxed);
+    if(top == bottom) {
+      /* That was the last one, so we have to race any thieves for it. */
+      if(!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+           memory_order_seq_cst, memory_order_relaxed)) {
+        object = NULL;
+      }
+      atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    }
+  } else {
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+  }
   return object;
 }
 
-void pushInt(VM* vm, int intValue) {
-  Object* object = newObject(vm, OBJ_INT);
-  object->value = intValue;
-  push(vm, object);
+/* Steal from the top of someone else's deque. Returns NULL if it's empty or
+   another thread got there first. */
+Object* dequeSteal(Deque* deque) {
+  long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+  atomic_thread_fence(memory_order_seq_cst);
+  long bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+  if(top >= bottom) return NULL;
+
+  DequeArray* array = atomic_load_explicit(&deque->array, memory_order_acquire);
+  Object* object = atomic_load_explicit(&array->items[top & (array->size - 1)], memory_order_relaxed);
+  if(!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+       memory_order_seq_cst, memory_order_relaxed)) {
+    return NULL;
+  }
+  return object;
 }
 
-Object* pushPair(VM* vm) {
-  Object* object = newObject(vm, OBJ_PAIR);
-  object->tail = pop(vm);
-  object->head = pop(vm);
+int dequeIsEmpty(Deque* deque) {
+  return atomic_load_explicit(&deque->bottom, memory_order_acquire) <=
+         atomic_load_explicit(&deque->top, memory_order_acquire);
+}
 
-  push(vm, object);
-  return object;
+/* Throw away the arrays we outgrew. Only safe once nobody can be stealing. */
+void trimDeque(Deque* deque) {
+  DequeArray* array = atomic_load_explicit(&deque->array, memory_order_relaxed);
+  DequeArray* previous = array->previous;
+  array->previous = NULL;
+  while(previous) {
+    DequeArray* next = previous->previous;
+    free(previous);
+    previous = next;
+  }
 }
 
-int main() {
-  /* Create a new VM */
-  VM* vm = newVM();
-  vm->maxObjects = 1;
+void freeDeque(Deque* deque) {
+  trimDeque(deque);
+  free(atomic_load_explicit(&deque->array, memory_order_relaxed));
+}
 
-  printf("Adding integer 0 to the stack.\n");
-  pushInt(vm, 0);
+/* What each thread in the pool runs: wait for a job, do it, repeat. */
+void* poolThread(void* arg) {
+  GCWorker* worker = (GCWorker *)arg;
+  VM* vm = worker->vm;
+  long seen = 0;
 
-  printf("Adding integer 1 to the stack.\n");
-  pushInt(vm, 1);
+  pthread_mutex_lock(&vm->poolLock);
+  for(;;) {
+    while(vm->poolGeneration == seen && !vm->poolShutdown) {
+      pthread_cond_wait(&vm->poolWake, &vm->poolLock);
+    }
+    if(vm->poolShutdown) break;
+    seen = vm->poolGeneration;
+    void (*job)(VM* vm, int worker) = vm->poolJob;
+    pthread_mutex_unlock(&vm->poolLock);
 
-  printf("Adding a pair to the stack (consuming two ints already there).\n");
-  pushPair(vm);
+    job(vm, worker->id);
+    traceFlush();
 
-  printf("There are now %d objects in stack and %d objects have been allocated.\n", vm->stackSize, vm->numObjects);
+    pthread_mutex_lock(&vm->poolLock);
+    if(--vm->poolBusy == 0) {
+      pthread_cond_signal(&vm->poolDone);
+    }
+  }
+  pthread_mutex_unlock(&vm->poolLock);
+  return NULL;
+}
 
-  /* Remove it from the stack, simulating the variable no longer being referenced. */
-  printf("Popping pair from the stack.\n");
-  Object* o = pop(vm);
+/* Run job on every GC thread at once, the calling one included, and wait
+   for them all to finish. */
+void runParallel(VM* vm, void (*job)(VM* vm, int worker)) {
+  pthread_mutex_lock(&vm->poolLock);
+  vm->poolJob = job;
+  vm->poolBusy = vm->gcThreads - 1;
+  vm->poolGeneration++;
+  pthread_cond_broadcast(&vm->poolWake);
+  pthread_mutex_unlock(&vm->poolLock);
 
-  printf("There are now %d objects in stack and %d objects have been allocated.\n", vm->stackSize, vm->numObjects);
+  job(vm, 0);
 
-  printf("Manual invoking GC (should free all)");
-  gc(vm);
+  pthread_mutex_lock(&vm->poolLock);
+  while(vm->poolBusy > 0) {
+    pthread_cond_wait(&vm->poolDone, &vm->poolLock);
+  }
+  pthread_mutex_unlock(&vm->poolLock);
+}
 
-  /* Done with the VM! */
-  free(vm);
+/* Every snapshot that's mapped in, whichever VM it belongs to, so that
+   snapshotFault() can find them. */
+_Atomic(Snapshot*) mappedSnapshots[SNAPSHOTS_MAX];
+/* Whoever was handling SIGSEGV before snapshotFault() came along. */
+struct sigaction previousSegvAction;
+pthread_once_t snapshotFaultOnce = PTHREAD_ONCE_INIT;
+size_t snapshotPageSize;
 
+/* Whether an object lives in one of the VM's snapshots, or a region
+   vmFreeze() made, rather than the heap. There's hardly ever more than one
+   of those, and usually none. */
+int inSnapshot(VM* vm, Object* object) {
+  for(int i = 0; i < vm->numSnapshots; i++) {
+    Snapshot* snapshot = vm->snapshots[i];
+    if(object >= snapshot->objects && object < snapshot->objectsEnd) return 1;
+  }
   return 0;
 }
+
+/* Whether an object is somewhere the collectors never free or move it: in
+   a snapshot or frozen region, or interned. None of them ever points at
+   anything that isn't immortal too. Marking doesn't need to ask, the mark
+   bits of interned pairs are always set. */
+int isImmortal(VM* vm, Object* object) {
+  return inSnapshot(vm, object) || (object->flags & OBJECT_INTERNED);
+}
+
+/* Where a pair holding head and tail goes in an intern table with room for
+   capacity pairs, or would go if it isn't there. */
+size_t internSlot(Object** table, size_t capacity, Value head, Value tail) {
+  uint64_t hash = ((uint64_t)head * 0x9E3779B97F4A7C15ull) ^ ((uint64_t)tail * 0xC2B2AE3D27D4EB4Full);
+  size_t slot = (size_t)(hash ^ (hash >> 32)) & (capacity - 1);
+  while(table[slot] != NULL && (table[slot]->head != head || table[slot]->tail != tail)) {
+    slot = (slot + 1) & (capacity - 1);
+  }
+  return slot;
+}
+
+/* Turn the offsets on one page of a snapshot's objects into pointers, in a
+   copy of it at copy. The objects start on a page boundary and every
+   Value is word aligned, so each Value is on exactly one page. All we have
+   to work out is which words are heads and tails rather than headers. */
+void relocatePage(Snapshot* snapshot, char* page, char* copy) {
+  char* end = page + snapshotPageSize;
+  if(end > (char *)snapshot->objectsEnd) end = (char *)snapshot->objectsEnd;
+  for(char* word = page; word < end; word += sizeof(Value)) {
+    size_t field = (size_t)(word - (char *)snapshot->objects) % sizeof(Object);
+    if(field != offsetof(Object, head) && field != offsetof(Object, tail)) continue;
+    Value* value = (Value *)(copy + (word - page));
+    if(isObject(*value)) *value = (Value)(snapshot->base + *value);
+  }
+}
+
+/* Relocate a page of a snapshot. Making the page itself writable would let
+   any other thread read it half done without faulting, so we do it in a
+   fresh page read from the file and swap that into place in one go. */
+void relocateSnapshotPage(Snapshot* snapshot, char* page) {
+  char* copy = (char *)mmap(NULL, snapshotPageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  assert(copy != MAP_FAILED); // Out of memory
+  /* The last page can run off the end of the file, which mapped in as
+     zeroes and reads as nothing, leaving the zeroes mmap() gave us. */
+  ssize_t read = pread(snapshot->fd, copy, snapshotPageSize, page - snapshot->base);
+  assert(read >= 0); // Couldn't read the snapshot
+  (void)read;
+  relocatePage(snapshot, page, copy);
+  mprotect(copy, snapshotPageSize, PROT_READ);
+  void* moved = mremap(copy, snapshotPageSize, snapshotPageSize, MREMAP_MAYMOVE | MREMAP_FIXED, page);
+  assert(moved == page); // Couldn't put the page in place
+  (void)moved;
+}
+
+/* The address this thread last faulted on in a page that turned out to be
+   relocated already, so snapshotFault() can tell a write, which faults
+   there again, from a read that lost a race with whoever relocated it. */
+_Thread_local char* relocatedFault = NULL;
+
+/* Somebody touched a page of a snapshot we haven't relocated yet, so
+   relocate it and let them carry on. The mutator and the marker threads
+   can fault on the same page at once, so whoever claims it first
+   relocates it and the others wait for them. Anything else is somebody
+   else's problem. */
+void snapshotFault(int signal, siginfo_t* info, void* context) {
+  (void)signal;
+  (void)context;
+  char* address = (char *)info->si_addr;
+  for(int i = 0; i < SNAPSHOTS_MAX; i++) {
+    Snapshot* snapshot = atomic_load(&mappedSnapshots[i]);
+    if(snapshot == NULL) continue;
+    if(address < (char *)snapshot->objects || address >= (char *)snapshot->objectsEnd) continue;
+
+    size_t index = (size_t)(address - (char *)snapshot->objects) / snapshotPageSize;
+    _Atomic(unsigned char)* state = &snapshot->relocated[index];
+    unsigned char seen = PAGE_UNTOUCHED;
+    if(atomic_compare_exchange_strong(state, &seen, PAGE_RELOCATING)) {
+      relocateSnapshotPage(snapshot, (char *)snapshot->objects + index * snapshotPageSize);
+      atomic_store(state, PAGE_RELOCATED);
+    } else {
+      while(atomic_load(state) != PAGE_RELOCATED) {
+        /* Somebody else is on it. */
+      }
+      /* Faulting twice in the same place on a relocated page is a write,
+         and snapshots are read-only. */
+      if(seen == PAGE_RELOCATED && relocatedFault == address) {
+        relocatedFault = NULL;
+        break;
+      }
+    }
+    relocatedFault = address;
+    return;
+  }
+
+  /* Not ours. Put back whoever was handling this before and let the
+     access fault again for them. */
+  sigaction(SIGSEGV, &previousSegvAction, NULL);
+}
+
+void installSnapshotFault() {
+  snapshotPageSize = (size_t)sysconf(_SC_PAGESIZE);
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_sigaction = snapshotFault;
+  action.sa_flags = SA_SIGINFO;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGSEGV, &action, &previousSegvAction);
+}
+
+/* Forget about a snapshot and give its memory back. */
+void unmapSnapshot(Snapshot* snapshot) {
+  for(int i = 0; i < SNAPSHOTS_MAX; i++) {
+    Snapshot* expected = snapshot;
+    if(atomic_compare_exchange_strong(&mappedSnapshots[i], &expected, NULL)) break;
+  }
+  munmap(snapshot->base, snapshot->length);
+  if(snapshot->fd >= 0) close(snapshot->fd);
+  free(snapshot->relocated);
+  free(snapshot);
+}
+
+void initSweepState(SweepState* state) {
+  state->freeHead = NULL;
+  state->freeTail = NULL;
+  state->swept = 0;
+  state->freed = 0;
+  state->youngGone = 0;
+  state->promoted = NULL;
+  state->promotedCount = 0;
+  state->promotedCapacity = 0;
+}
+
+/* A monotonic clock in nanoseconds, for timing the GC. */
+long nanoTime() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/* The concurrent marker's version of mark(). Nobody else marks while it's
+   running, but the program is allocating black, so it still has to mark
+   with tryMark(). */
+void markerShade(VM* vm, Value value) {
+  if(!isObject(value)) return;
+  Object* object = asObject(value);
+  if(inSnapshot(vm, object)) return;
+  if(!tryMark(object)) return;
+  vm->markerMarked++;
+
+  if(vm->markerGrayCount == vm->markerGrayCapacity) {
+    vm->markerGrayCapacity = vm->markerGrayCapacity ? vm->markerGrayCapacity * 2 : GRAY_STACK_INITIAL;
+    vm->markerGray = (Object **)realloc(vm->markerGray, sizeof(Object*) * vm->markerGrayCapacity);
+    assert(vm->markerGray != NULL); // Out of memory
+  }
+  vm->markerGray[vm->markerGrayCount++] = object;
+}
+
+/* Go through the stack while the program's pushing and popping. We only
+   look below the stackSize we read, and push() publishes stackSize after
+   the entry it wrote, so everything we see is something that's been on the
+   stack this collection: either it's still there, or pop() shaded it on
+   the way out. Either way it hasn't been swept, nothing's swept while
+   we're marking. */
+void markerScan(VM* vm) {
+  int size = __atomic_load_n(&vm->stackSize, __ATOMIC_ACQUIRE);
+  for(int i = 0; i < size; i++) {
+    markerShade(vm, __atomic_load_n(&vm->stack[i], __ATOMIC_RELAXED));
+  }
+}
+
+/* Trace from the marker's gray objects until there aren't any, by way of a
+   PrefetchWindow like traceGray(). The program might be storing into these
+   pairs as we read them, but whatever we read, old or new, setHead() and
+   setTail() shaded the old one first. */
+void markerTrace(VM* vm) {
+  PrefetchWindow window;
+  initWindow(&window);
+  for(;;) {
+    while(!windowIsFull(&window) && vm->markerGrayCount > 0) {
+      windowPush(&window, vm->markerGray[--vm->markerGrayCount]);
+    }
+    Object* object = windowTake(&window);
+    if(object == NULL) break;
+    size_t count;
+    Value* fields = objectFields(object, &count);
+    for(size_t i = 0; i < count; i++) {
+      markerShade(vm, __atomic_load_n(&fields[i], __ATOMIC_ACQUIRE));
+    }
+  }
+}
+
+/* What the marker thread runs: wait to be given the stack or some shaded
+   objects, trace from them, and say so when there's nothing left. Between
+   the time it says so and the time it's given something else to do, it
+   doesn't touch anything, so finishConcurrentMark() can use its gray stack. */
+void* markerThread(void* arg) {
+  VM* vm = (VM *)arg;
+
+  pthread_mutex_lock(&vm->markerLock);
+  for(;;) {
+    while(!vm->markerShutdown && !vm->markerScanStack && vm->satbQueueCount == 0) {
+      pthread_cond_wait(&vm->markerWake, &vm->markerLock);
+    }
+    if(vm->markerShutdown) break;
+    int scanStack = vm->markerScanStack;
+    vm->markerScanStack = 0;
+    long start = nanoTime();
+    for(int i = 0; i < vm->satbQueueCount; i++) {
+      markerShade(vm, objectValue(vm->satbQueue[i]));
+    }
+    vm->satbQueueCount = 0;
+    pthread_mutex_unlock(&vm->markerLock);
+
+    if(scanStack) markerScan(vm);
+    markerTrace(vm);
+    traceFlush();
+
+    pthread_mutex_lock(&vm->markerLock);
+    vm->markerNanos += nanoTime() - start;
+    if(!vm->markerScanStack && vm->satbQueueCount == 0) {
+      atomic_store(&vm->markerIdle, 1);
+      pthread_cond_signal(&vm->markerDone);
+    }
+  }
+  pthread_mutex_unlock(&vm->markerLock);
+  return NULL;
+}
+
+/* Give a payload in the large object space back. */
+void freeLarge(VM* vm, LargeObject* large) {
+  vm->largeBytes -= (long)large->size;
+  vm->cycle.bytesFreed += (long)large->size;
+  if(large->size >= LARGE_MMAP_MIN) {
+    munmap(large, large->size);
+  } else {
+    free(large);
+  }
+}
+
+/* Tear down the VM, giving all of the chunks back in one go, to the shared
+   pool for the next VM where there's room. */
+void freeVM(VM* vm) {
+  if(vm->workers) {
+    pthread_mutex_lock(&vm->poolLock);
+    vm->poolShutdown = 1;
+    pthread_cond_broadcast(&vm->poolWake);
+    pthread_mutex_unlock(&vm->poolLock);
+    for(int i = 0; i < vm->gcThreads; i++) {
+      if(i > 0) pthread_join(vm->workers[i].thread, NULL);
+      freeDeque(&vm->workers[i].deque);
+      free(vm->workers[i].sweep.promoted);
+    }
+    free(vm->workers);
+    pthread_mutex_destroy(&vm->poolLock);
+    pthread_cond_destroy(&vm->poolWake);
+    pthread_cond_destroy(&vm->poolDone);
+  }
+  /* The marker might be in the middle of something, but it'll see this
+     once it's done, and we can't free the chunks out from under it. */
+  if(vm->concurrent) {
+    pthread_mutex_lock(&vm->markerLock);
+    vm->markerShutdown = 1;
+    pthread_cond_signal(&vm->markerWake);
+    pthread_mutex_unlock(&vm->markerLock);
+    pthread_join(vm->marker, NULL);
+    pthread_mutex_destroy(&vm->markerLock);
+    pthread_cond_destroy(&vm->markerWake);
+    pthread_cond_destroy(&vm->markerDone);
+  }
+
+  for(int i = 0; i < vm->numChunks; i++) {
+    giveChunk(vm->chunks[i]);
+  }
+  free(vm->chunks);
+  for(int i = 0; i < vm->numInternChunks; i++) {
+    giveChunk(vm->internChunks[i]);
+  }
+  free(vm->internChunks);
+  free(vm->interned);
+  while(vm->largeObjects) {
+    LargeObject* large = vm->largeObjects;
+    vm->largeObjects = large->next;
+    freeLarge(vm, large);
+  }
+  for(int i = 0; i < vm->numSnapshots; i++) {
+    unmapSnapshot(vm->snapshots[i]);
+  }
+  free(vm->snapshots);
+  munmap(vm->stack, sizeof(Value) * (size_t)vm->stackLimit);
+  free(vm->sweepState.promoted);
+  free(vm->fromSpace);
+  free(vm->grayStack);
+  free(vm->satbQueue);
+  free(vm->satbBuffer);
+  free(vm->markerGray);
+  free(vm->remembered);
+  free(vm->weakRefs);
+  free(vm->cleared);
+  free(vm->sites);
+  free(vm->samples);
+  free(vm);
+}
+
+/* Which pause histogram bucket a pause of nanos goes in. Pauses under
+   PAUSE_SUB_BUCKETS nanoseconds get a bucket each, after that it's
+   PAUSE_SUB_BUCKETS buckets for each power of two. */
+int pauseBucket(long nanos) {
+  if(nanos < PAUSE_SUB_BUCKETS) return nanos < 0 ? 0 : (int)nanos;
+  int magnitude = 63 - __builtin_clzl((unsigned long)nanos);
+  int sub = (int)(nanos >> (magnitude - PAUSE_SUB_BITS)) & (PAUSE_SUB_BUCKETS - 1);
+  return (magnitude - PAUSE_SUB_BITS + 1) * PAUSE_SUB_BUCKETS + sub;
+}
+
+/* The shortest pause that lands in a bucket. */
+long pauseBucketStart(int bucket) {
+  if(bucket < PAUSE_SUB_BUCKETS) return bucket;
+  int magnitude = bucket / PAUSE_SUB_BUCKETS + PAUSE_SUB_BITS - 1;
+  long sub = bucket % PAUSE_SUB_BUCKETS;
+  return (PAUSE_SUB_BUCKETS + sub) << (magnitude - PAUSE_SUB_BITS);
+}
+
+/* Roughly how long the program had to wait for the given percentage of
+   pauses, 0 to 100, give or take a bucket. */
+long pausePercentile(const GCStats* stats, double percentile) {
+  if(stats->pauses == 0) return 0;
+  long wanted = (long)(stats->pauses * percentile / 100.0 + 0.5);
+  if(wanted < 1) wanted = 1;
+  long seen = 0;
+  for(int i = 0; i < PAUSE_BUCKETS; i++) {
+    seen += stats->pauseHistogram[i];
+    if(seen >= wanted) {
+      long end = i + 1 < PAUSE_BUCKETS ? pauseBucketStart(i + 1) - 1 : stats->maxPauseNanos;
+      return end < stats->maxPauseNanos ? end : stats->maxPauseNanos;
+    }
+  }
+  return stats->maxPauseNanos;
+}
+
+/* Call these around anything that makes the program wait for the GC. */
+void pauseBegin(VM* vm) {
+  if(vm->pauseDepth++ == 0) vm->pauseStart = nanoTime();
+}
+
+void pauseEnd(VM* vm) {
+  if(--vm->pauseDepth > 0) return;
+  long nanos = nanoTime() - vm->pauseStart;
+  GCStats* stats = &vm->stats;
+  stats->pauses++;
+  stats->totalPauseNanos += nanos;
+  if(nanos > stats->maxPauseNanos) stats->maxPauseNanos = nanos;
+  stats->pauseHistogram[pauseBucket(nanos)]++;
+}
+
+/* How many bytes the objects we're holding on to take up. */
+long heapBytes(VM* vm) {
+  return (long)vm->numObjects * sizeof(Object) + vm->largeBytes;
+}
+
+/* How many bytes the old generation takes up. We count all of the large
+   object space as old: a payload big enough to matter is usually going to
+   stick around, and this way piling them up forces a full collection. */
+long oldBytes(VM* vm) {
+  return (long)(vm->numObjects - vm->numYoung) * sizeof(Object) + vm->largeBytes;
+}
+
+/* The copying collector collects when its space fills up. */
+long thresholdCopying(VM* vm, int full) {
+  (void)full;
+  return (long)vm->spaceCapacity * sizeof(Object);
+}
+
+/* The mark-sweep collector collects when the heap reaches maxBytes. */
+long thresholdInChunks(VM* vm, int full) {
+  (void)full;
+  return vm->maxBytes;
+}
+
+/* The generational collector does too, or for a minor collection when the
+   nursery fills up. */
+long thresholdGenerational(VM* vm, int full) {
+  if(!full) return (long)vm->nurserySize * sizeof(Object);
+  return vm->maxBytes;
+}
+
+/* How many bytes it takes to trigger a collection like this one. */
+long gcThreshold(VM* vm, int full) {
+  return vm->ops->threshold(vm, full);
+}
+
+/* The adaptive heuristic. If we spent more of the time since it last
+   looked collecting than gcTimeRatio says, grow the heap faster so we
+   collect less often, and if we spent less, let it shrink back. How often
+   we collect goes roughly as 1 / (heapGrowth - 1), so that's what gets
+   scaled, a limited amount at a time so one odd collection can't throw it
+   right off. */
+void adaptGrowth(VM* vm) {
+  GCStats* stats = &vm->stats;
+  long now = nanoTime();
+  /* The collection that's just finishing hasn't been added to the totals
+     yet. */
+  long gcNow = stats->totalMarkNanos + stats->totalSweepNanos + vm->markNanos + vm->cycle.sweepNanos;
+  long gcNanos = gcNow - vm->adaptGCNanos;
+  long mutatorNanos = now - vm->adaptStart - gcNanos;
+  vm->adaptStart = now;
+  vm->adaptGCNanos = gcNow;
+  if(mutatorNanos < 1) mutatorNanos = 1;
+
+  double scale = (double)gcNanos / mutatorNanos / vm->gcTimeRatio;
+  if(scale > HEAP_GROWTH_STEP) scale = HEAP_GROWTH_STEP;
+  if(scale < 1.0 / HEAP_GROWTH_STEP) scale = 1.0 / HEAP_GROWTH_STEP;
+  vm->heapGrowth = 1.0 + (vm->heapGrowth - 1.0) * scale;
+  if(vm->heapGrowth > HEAP_GROWTH_MAX) vm->heapGrowth = HEAP_GROWTH_MAX;
+  if(vm->heapGrowth < HEAP_GROWTH_MIN) vm->heapGrowth = HEAP_GROWTH_MIN;
+}
+
+/* Work out when the next full collection is due, now that liveBytes
+   survived this one. */
+void setNextGC(VM* vm, long liveBytes) {
+  if(vm->adaptive) adaptGrowth(vm);
+  long next = (long)(liveBytes * vm->heapGrowth);
+  if(next < vm->minHeapBytes) next = vm->minHeapBytes;
+  if(vm->maxHeapBytes > 0 && next > vm->maxHeapBytes) next = vm->maxHeapBytes;
+  vm->maxBytes = next;
+}
+
+/* Start keeping track of a new collection. */
+void startCycle(VM* vm, int full) {
+  memset(&vm->cycle, 0, sizeof(GCCycle));
+  vm->cycle.full = full;
+  vm->cycle.thresholdBefore = gcThreshold(vm, full);
+}
+
+/* Tot up a collection that's finished. */
+void finishCycle(VM* vm, int swept, int freed) {
+  GCCycle* cycle = &vm->cycle;
+  GCStats* stats = &vm->stats;
+  cycle->markNanos = vm->markNanos;
+  cycle->marked = vm->numMarked;
+  cycle->swept = swept;
+  cycle->freed = freed;
+  /* Plus whatever the large object space gave back, which is already in
+     here. */
+  cycle->bytesFreed += (long)freed * sizeof(Object);
+  cycle->thresholdAfter = gcThreshold(vm, cycle->full);
+
+  stats->last = *cycle;
+  stats->collections++;
+  if(!cycle->full) stats->minorCollections++;
+  stats->totalMarked += cycle->marked;
+  stats->totalMarkNanos += cycle->markNanos;
+  stats->totalSweepNanos += cycle->sweepNanos;
+  stats->totalFreed += freed;
+  stats->totalBytesFreed += cycle->bytesFreed;
+}
+
+/* Everything we know about this VM's collections so far. */
+const GCStats* vmGetStats(VM* vm) {
+  return &vm->stats;
+}
+
+void mark(VM* vm, Value value) {
+
+  /* Ints aren't in the heap, so there's nothing to mark. Neither are
+     objects in a snapshot, which never point back into it either. */
+  if(!isObject(value)) return;
+  Object* object = asObject(value);
+  if(inSnapshot(vm, object)) return;
+
+  /* Return if we've already marked this one. This prevents cycles and thereby
+     explosions due to running forever. */
+  if(isMarked(object)) return;
+
+  /* A minor collection assumes everything old is alive. Anything young an
+     old object points at is found through the remembered set instead. */
+  if(vm->collectingYoung && (object->flags & OBJECT_OLD)) return;
+
+  /* Mark the object as reachable. */
+  setMarked(object);
+  vm->numMarked++;
+
+  /* If the object is a pair, its two fields are reachable too. Rather than
+     marking them right now we put it on the gray stack and get to it in
+     traceGray(). We don't even look at its type until then: so far we
+     haven't touched the object itself, only its chunk's mark bits, and
+     traceGray() will have prefetched it by the time it looks. */
+  if(vm->grayCount == vm->grayCapacity) {
+    vm->grayCapacity = vm->grayCapacity ? vm->grayCapacity * 2 : GRAY_STACK_INITIAL;
+    vm->grayStack = (Object **)realloc(vm->grayStack, sizeof(Object*) * vm->grayCapacity);
+    assert(vm->grayStack != NULL); // Out of memory
+  }
+  vm->grayStack[vm->grayCount++] = object;
+}
+
+/* Mark everything an object points to. */
+void traceObject(VM* vm, Object* object) {
+  size_t count;
+  Value* fields = objectFields(object, &count);
+  for(size_t i = 0; i < count; i++) {
+    mark(vm, fields[i]);
+  }
+}
+
+/* Pop one gray object and mark what it points to, turning it black. */
+void traceOne(VM* vm) {
+  traceObject(vm, vm->grayStack[--vm->grayCount]);
+}
+
+/* Keep popping gray objects and marking what they point to until there's
+   nothing gray left. They go through a PrefetchWindow on the way, so we're
+   not waiting on memory for each one. */
+void traceGray(VM* vm) {
+  PrefetchWindow window;
+  initWindow(&window);
+  for(;;) {
+    while(!windowIsFull(&window) && vm->grayCount > 0) {
+      windowPush(&window, vm->grayStack[--vm->grayCount]);
+    }
+    Object* object = windowTake(&window);
+    if(object == NULL) break;
+    traceObject(vm, object);
+  }
+}
+
+/* The parallel version of mark(): mark the object if nobody else has, and
+   if it's a pair put it on this worker's deque. */
+void markParallel(VM* vm, GCWorker* worker, Value value) {
+  if(!isObject(value)) return;
+  Object* object = asObject(value);
+  if(inSnapshot(vm, object)) return;
+  if(vm->collectingYoung && (object->flags & OBJECT_OLD)) return;
+  if(!tryMark(object)) return;
+  worker->numMarked++;
+  dequePush(&worker->deque, object);
+}
+
+/* The parallel version of traceObject(). */
+void traceParallel(VM* vm, GCWorker* worker, Object* object) {
+  size_t count;
+  Value* fields = objectFields(object, &count);
+  for(size_t i = 0; i < count; i++) {
+    markParallel(vm, worker, fields[i]);
+  }
+}
+
+/* Try to steal a gray object from one of the other workers, starting with
+   a random one so we don't all gang up on the same victim. */
+Object* stealWork(VM* vm, GCWorker* worker) {
+  int count = vm->gcThreads;
+  int first = (int)(rand_r(&worker->seed) % count);
+  for(int i = 0; i < count; i++) {
+    int victim = (first + i) % count;
+    if(victim == worker->id) continue;
+    Object* object = dequeSteal(&vm->workers[victim].deque);
+    if(object) return object;
+  }
+  return NULL;
+}
+
+int anyWorkLeft(VM* vm) {
+  for(int i = 0; i < vm->gcThreads; i++) {
+    if(!dequeIsEmpty(&vm->workers[i].deque)) return 1;
+  }
+  return 0;
+}
+
+/* What each marking thread runs. It marks its share of the roots, then
+   drains its own deque, then steals from the others. Once every worker is
+   out of work and there's nothing left to steal we're done. */
+void parallelMarkJob(VM* vm, int id) {
+  GCWorker* worker = &vm->workers[id];
+  int count = vm->gcThreads;
+
+  for(int i = vm->stackSize * id / count; i < vm->stackSize * (id + 1) / count; i++) {
+    markParallel(vm, worker, vm->stack[i]);
+  }
+  if(vm->collectingYoung) {
+    int from = vm->rememberedCount * id / count;
+    int to = vm->rememberedCount * (id + 1) / count;
+    for(int i = from; i < to; i++) {
+      traceParallel(vm, worker, vm->remembered[i]);
+    }
+  }
+
+  PrefetchWindow window;
+  initWindow(&window);
+  for(;;) {
+    /* Work through our own deque by way of a PrefetchWindow, like
+       traceGray(). What's in the window is ours, nobody can steal it. */
+    for(;;) {
+      Object* object;
+      while(!windowIsFull(&window) && (object = dequeTake(&worker->deque)) != NULL) {
+        windowPush(&window, object);
+      }
+      object = windowTake(&window);
+      if(object == NULL) break;
+      traceParallel(vm, worker, object);
+    }
+
+    Object* object = stealWork(vm, worker);
+    if(object) {
+      traceParallel(vm, worker, object);
+      continue;
+    }
+
+    /* Nothing to do. Say so, then wait until either someone has work we
+       can steal or everyone is idle, at which point nobody can make more. */
+    atomic_fetch_add(&vm->idleWorkers, 1);
+    for(;;) {
+      if(atomic_load(&vm->idleWorkers) == count) return;
+      if(anyWorkLeft(vm)) {
+        atomic_fetch_sub(&vm->idleWorkers, 1);
+        break;
+      }
+      sched_yield();
+    }
+  }
+}
+
+/* Mark with all of the GC threads. */
+void markParallelAll(VM* vm) {
+  atomic_store(&vm->idleWorkers, 0);
+  for(int i = 0; i < vm->gcThreads; i++) {
+    vm->workers[i].numMarked = 0;
+  }
+  runParallel(vm, parallelMarkJob);
+  for(int i = 0; i < vm->gcThreads; i++) {
+    vm->numMarked += vm->workers[i].numMarked;
+    trimDeque(&vm->workers[i].deque);
+  }
+}
+
+/* To mark all of the reachable objects, we start with the variables that are
+   in memory, so that means walking the stack. Using mark() this will
+   mark every object in memory that is reachable. */
+void markAll(VM* vm) {
+  TRACE(1, "\tMarking %d objects\n", vm->stackSize);
+  long start = nanoTime();
+  vm->numMarked = 0;
+  if(vm->gcThreads > 1) {
+    markParallelAll(vm);
+  } else {
+    for(int i = 0; i < vm->stackSize; i++) {
+      mark(vm, vm->stack[i]);
+    }
+    if(vm->collectingYoung) {
+      for(int i = 0; i < vm->rememberedCount; i++) {
+        traceObject(vm, vm->remembered[i]);
+      }
+    }
+    traceGray(vm);
+  }
+  vm->markNanos = nanoTime() - start;
+  TRACE(1, "\tMarked %d reachable objects in %ldns (%.1fns per object)\n",
+    vm->numMarked, vm->markNanos,
+    vm->numMarked ? (double)vm->markNanos / vm->numMarked : 0.0);
+}
+
+int isYoung(Object* object) {
+  return !(object->flags & OBJECT_OLD);
+}
+
+/* Whether a value points into the nursery. Ints never do. */
+int isYoungValue(Value value) {
+  return isObject(value) && isYoung(asObject(value));
+}
+
+/* Whether any of an object's fields point into the nursery. */
+int pointsAtYoung(Object* object) {
+  size_t count;
+  Value* fields = objectFields(object, &count);
+  for(size_t i = 0; i < count; i++) {
+    if(isYoungValue(fields[i])) return 1;
+  }
+  return 0;
+}
+
+/* Queue up what a cleared weak reference wanted handed back. */
+void enqueueCleared(VM* vm, Value data) {
+  if(vm->clearedCount == vm->clearedCapacity) {
+    /* Slide what's still waiting down to the front before making room. */
+    int waiting = vm->clearedCount - vm->clearedNext;
+    if(waiting > 0) memmove(vm->cleared, vm->cleared + vm->clearedNext, sizeof(Value) * waiting);
+    vm->clearedNext = 0;
+    vm->clearedCount = waiting;
+    if(waiting * 2 >= vm->clearedCapacity) {
+      vm->clearedCapacity = vm->clearedCapacity ? vm->clearedCapacity * 2 : REMEMBERED_INITIAL;
+      vm->cleared = (Value *)realloc(vm->cleared, sizeof(Value) * vm->clearedCapacity);
+      assert(vm->cleared != NULL); // Out of memory
+    }
+  }
+  vm->cleared[vm->clearedCount++] = data;
+}
+
+/* Whether a collection like the one that's just marked is going to free
+   an object. */
+int isDying(VM* vm, Object* object) {
+  return !isMarked(object) && (!vm->collectingYoung || isYoung(object));
+}
+
+/* Mark from the cleared queue, then clear the weak references whose
+   targets didn't get marked, queueing up their data. This happens at the
+   end of marking, before anything else looks at the marks. It only ever
+   goes through the weak references and the queue, never the rest of the
+   heap, and weak references that are garbage themselves, or that have been
+   cleared, drop off the list so we don't look at them again. */
+void processWeakRefs(VM* vm) {
+  if(vm->weakCount == 0 && vm->clearedNext == vm->clearedCount) return;
+  for(int i = vm->clearedNext; i < vm->clearedCount; i++) {
+    mark(vm, vm->cleared[i]);
+  }
+  traceGray(vm);
+
+  int kept = 0;
+  int cleared = 0;
+  for(int i = 0; i < vm->weakCount; i++) {
+    Object* weak = vm->weakRefs[i];
+    if(isDying(vm, weak)) continue;
+    if(!isDying(vm, asObject(weak->head))) {
+      vm->weakRefs[kept++] = weak;
+      continue;
+    }
+    weak->head = NIL_VALUE;
+    cleared++;
+    /* Its data was marked along with the weak reference. */
+    if(weak->tail != NIL_VALUE) enqueueCleared(vm, weak->tail);
+  }
+  vm->weakCount = kept;
+  TRACE(1, "\tCleared %d weak references, %d left.\n", cleared, kept);
+}
+
+/* Forget the sampled objects the collection that's just marked is going to
+   free, and tot up how much of what's left came from each site. */
+void processSamples(VM* vm) {
+  if(vm->sampleRate == 0) return;
+  for(int i = 0; i < vm->numSites; i++) {
+    vm->sites[i].survivingBytes = 0;
+  }
+  int kept = 0;
+  for(int i = 0; i < vm->numSamples; i++) {
+    Sample sample = vm->samples[i];
+    if(isDying(vm, sample.object)) continue;
+    vm->sites[sample.site].survivingBytes += objectBytes(sample.object) * vm->sampleRate;
+    vm->samples[kept++] = sample;
+  }
+  vm->numSamples = kept;
+}
+
+/* Have another look at every site that's had enough young objects since
+   the last time, now that a sweep has promoted whatever it's going to. */
+void decidePretenuring(VM* vm) {
+  for(int i = 0; i < vm->numSites; i++) {
+    AllocationSite* site = &vm->sites[i];
+    if(site->young < PRETENURE_WINDOW) continue;
+    int pretenured = site->promoted * 100 >= site->young * PRETENURE_PERCENT;
+    if(pretenured != site->pretenured) {
+      TRACE(1, "\t%s objects from %s, %ld of %ld promoted.\n",
+        pretenured ? "Pretenuring" : "No longer pretenuring", site->name, site->promoted, site->young);
+    }
+    site->pretenured = pretenured;
+    site->young /= 2;
+    site->promoted /= 2;
+  }
+}
+
+/* Add an old pair or array to the remembered set, unless it's there
+   already. */
+void remember(VM* vm, Object* object) {
+  if(object->flags & OBJECT_REMEMBERED) return;
+  object->flags |= OBJECT_REMEMBERED;
+
+  if(vm->rememberedCount == vm->rememberedCapacity) {
+    vm->rememberedCapacity = vm->rememberedCapacity ? vm->rememberedCapacity * 2 : REMEMBERED_INITIAL;
+    vm->remembered = (Object **)realloc(vm->remembered, sizeof(Object*) * vm->rememberedCapacity);
+    assert(vm->remembered != NULL); // Out of memory
+  }
+  vm->remembered[vm->rememberedCount++] = object;
+}
+
+/* Drop pairs from the remembered set that no longer point into the nursery.
+   If onlyMarked is set, also drop the ones that weren't marked, since the
+   sweep that's about to happen will free them. */
+void pruneRemembered(VM* vm, int onlyMarked) {
+  int kept = 0;
+  for(int i = 0; i < vm->rememberedCount; i++) {
+    Object* object = vm->remembered[i];
+    if((!onlyMarked || isMarked(object)) && pointsAtYoung(object)) {
+      vm->remembered[kept++] = object;
+    } else {
+      object->flags &= ~OBJECT_REMEMBERED;
+    }
+  }
+  vm->rememberedCount = kept;
+}
+
+/* Note a promoted pair so we can remember it once the sweep is over. */
+void pushPromoted(SweepState* state, Object* object) {
+  if(state->promotedCount == state->promotedCapacity) {
+    state->promotedCapacity = state->promotedCapacity ? state->promotedCapacity * 2 : REMEMBERED_INITIAL;
+    state->promoted = (Object **)realloc(state->promoted, sizeof(Object*) * state->promotedCapacity);
+    assert(state->promoted != NULL); // Out of memory
+  }
+  state->promoted[state->promotedCount++] = object;
+}
+
+/* Sweep one chunk, adding what we find to state. For a full collection
+   anything live might be garbage, for a minor one only young objects might.
+   Whichever of those weren't marked go back on the free list, and if we're
+   generational the young survivors get older and the oldest are promoted.
+   Then the chunk's marks get wiped in one go, ready for the next GC.
+
+   This doesn't change anything in the VM itself, so several threads can
+   sweep different chunks at the same time. */
+void sweepChunk(VM* vm, Chunk* chunk, int full, SweepState* state) {
+  for(int w = 0; w < MARK_WORDS; w++) {
+    uint64_t candidates = full ? chunk->live[w] : chunk->young[w];
+    uint64_t marks = chunk->marks[w];
+    uint64_t dead = candidates & ~marks;
+
+    state->swept += __builtin_popcountll(candidates);
+    state->freed += __builtin_popcountll(dead);
+    state->youngGone += __builtin_popcountll(dead & chunk->young[w]);
+    chunk->live[w] &= ~dead;
+    chunk->young[w] &= ~dead;
+
+    /* Hand the unreached slots back. These are the only objects we actually
+       have to touch, and they go on the end of the list so that it, and
+       the VM's once that's been added to, stays in address order. */
+    while(dead) {
+      Object* object = &chunk->objects[w * 64 + __builtin_ctzll(dead)];
+      object->next = NULL;
+      if(state->freeTail) {
+        state->freeTail->next = object;
+      } else {
+        state->freeHead = object;
+      }
+      state->freeTail = object;
+      dead &= dead - 1;
+    }
+
+    if(vm->generational) {
+      uint64_t survivors = chunk->young[w] & marks;
+      while(survivors) {
+        int bit = __builtin_ctzll(survivors);
+        Object* object = &chunk->objects[w * 64 + bit];
+        survivors &= survivors - 1;
+        /* Anything allocated here since the collection was only marked to
+           keep it safe from this sweep. It hasn't survived anything yet, so
+           it doesn't get any older. */
+        if(object->flags & OBJECT_UNSWEPT) {
+          object->flags &= ~OBJECT_UNSWEPT;
+          continue;
+        }
+        if(++object->age >= vm->promotionAge) {
+          /* This object has been around for a while, promote it. If it's a
+             pair it might still point at young objects, so it might need
+             remembering. */
+          object->flags |= OBJECT_OLD;
+          chunk->young[w] &= ~((uint64_t)1 << bit);
+          state->youngGone++;
+          if(object->type != OBJ_BYTES || vm->pretenure) pushPromoted(state, object);
+        }
+      }
+    }
+  }
+
+  memset(chunk->marks, 0, sizeof(chunk->marks));
+  chunk->needsSweep = 0;
+}
+
+/* Move the slots a sweep has freed onto the end of the VM's free list.
+   The chunks are swept in address order, so that's where they belong. */
+void spliceFreeList(VM* vm, SweepState* state) {
+  if(state->freeHead == NULL) return;
+  if(vm->freeList) {
+    vm->freeListTail->next = state->freeHead;
+  } else {
+    vm->freeList = state->freeHead;
+  }
+  vm->freeListTail = state->freeTail;
+  state->freeHead = NULL;
+  state->freeTail = NULL;
+}
+
+/* Fold what a parallel sweeping thread found into the VM's sweep. */
+void mergeSweepState(VM* vm, SweepState* state) {
+  spliceFreeList(vm, state);
+  vm->sweepState.swept += state->swept;
+  vm->sweepState.freed += state->freed;
+  vm->sweepState.youngGone += state->youngGone;
+  for(int i = 0; i < state->promotedCount; i++) {
+    pushPromoted(&vm->sweepState, state->promoted[i]);
+  }
+  state->swept = 0;
+  state->freed = 0;
+  state->youngGone = 0;
+  state->promotedCount = 0;
+}
+
+/* Sweep the large object space, freeing the payloads of the objects the
+   collection that's just marked didn't reach. It has to happen before the
+   chunks are swept, while the owners' mark bits still mean something, but
+   there's only ever one of these per array or byte buffer, so it's quick
+   even when the chunks are being swept lazily. The Objects that owned them
+   are left for the chunk sweep. */
+void sweepLarge(VM* vm, int full) {
+  int freed = 0;
+  LargeObject** link = &vm->largeObjects;
+  while(*link) {
+    LargeObject* large = *link;
+    Object* owner = large->owner;
+    if(!isMarked(owner) && (full || isYoung(owner))) {
+      *link = large->next;
+      freeLarge(vm, large);
+      freed++;
+    } else {
+      link = &large->next;
+    }
+  }
+  TRACE(1, "\tFreed %d payloads in the large object space, %ld bytes left.\n", freed, vm->largeBytes);
+}
+
+/* Get ready to sweep after marking. Every chunk we have right now needs
+   sweeping. Chunks we grow while a lazy sweep is under way don't, and
+   objects allocated in chunks that haven't been swept yet are born marked
+   so the sweep leaves them alone. */
+void startSweep(VM* vm, int full) {
+  sweepLarge(vm, full);
+  vm->sweeping = 1;
+  vm->sweepingFull = full;
+  vm->sweepCursor = 0;
+  for(int i = 0; i < vm->numChunks; i++) {
+    vm->chunks[i]->needsSweep = 1;
+  }
+}
+
+/* Whether nothing in a chunk is in use. */
+int isEmptyChunk(Chunk* chunk) {
+  for(int w = 0; w < MARK_WORDS; w++) {
+    if(chunk->live[w]) return 0;
+  }
+  return 1;
+}
+
+/* Give back the chunks that every sweep for the last releaseDelay has
+   found empty. We wait a little because a program whose garbage comes in
+   bursts would only want them again straight away. Their slots are all on
+   the free list, so that has to lose them first, which means going through
+   it, but only when there's something to give back. The chunk we're bump
+   allocating from always stays. */
+void releaseEmptyChunks(VM* vm) {
+  if(vm->releaseDelay < 0) return;
+  int kept = 0;
+  int released = 0;
+  Chunk** releasing = NULL;
+  for(int i = 0; i < vm->numChunks; i++) {
+    Chunk* chunk = vm->chunks[i];
+    int bumping = vm->bump < vm->bumpEnd && chunkFor(vm->bump) == chunk;
+    if(bumping || !isEmptyChunk(chunk)) {
+      chunk->emptyFor = 0;
+    } else if(++chunk->emptyFor > vm->releaseDelay) {
+      /* Move it to the end of the array, out of the way. */
+      if(releasing == NULL) {
+        releasing = (Chunk **)malloc(sizeof(Chunk*) * (vm->numChunks - i));
+        assert(releasing != NULL); // Out of memory
+      }
+      releasing[released++] = chunk;
+      continue;
+    }
+    vm->chunks[kept++] = chunk;
+  }
+  if(released == 0) return;
+
+  Object** link = &vm->freeList;
+  while(*link) {
+    if(chunkFor(*link)->emptyFor > vm->releaseDelay) {
+      *link = (*link)->next;
+    } else {
+      vm->freeListTail = *link;
+      link = &(*link)->next;
+    }
+  }
+  for(int i = 0; i < released; i++) {
+    giveChunk(releasing[i]);
+  }
+  free(releasing);
+  vm->numChunks = kept;
+  TRACE(1, "\tReleased %d empty chunks, %d left.\n", released, kept);
+}
+
+/* Report something wrong that verifyHeap() found. Past the first few we
+   just count them. */
+void heapProblem(int* problems, const char* format, ...) {
+  if((*problems)++ >= 10) return;
+  va_list args;
+  va_start(args, format);
+  fprintf(stderr, "verifyHeap: ");
+  vfprintf(stderr, format, args);
+  fprintf(stderr, "\n");
+  va_end(args);
+}
+
+/* Whether an object is in one of the intern chunks, without taking its
+   word for it. */
+int isInterned(VM* vm, Object* object) {
+  for(int i = 0; i < vm->numInternChunks; i++) {
+    if(chunkFor(object) == vm->internChunks[i]) return 1;
+  }
+  return 0;
+}
+
+int compareChunks(const void* a, const void* b) {
+  uintptr_t left = (uintptr_t)*(Chunk* const *)a;
+  uintptr_t right = (uintptr_t)*(Chunk* const *)b;
+  return left < right ? -1 : left > right;
+}
+
+/* Whether an object is somewhere we allocate objects, and in use. chunks
+   is the VM's chunks sorted by address. */
+int isHeapObject(VM* vm, Chunk** chunks, Object* object) {
+  if(vm->collector == COLLECTOR_COPYING) {
+    return object >= vm->fromSpace && object < vm->fromSpace + vm->spaceUsed &&
+      (uintptr_t)((char *)object - (char *)vm->fromSpace) % sizeof(Object) == 0;
+  }
+  Chunk* chunk = chunkFor(object);
+  if(!bsearch(&chunk, chunks, (size_t)vm->numChunks, sizeof(Chunk*), compareChunks)) return 0;
+  if(object < chunk->objects || object >= chunk->objects + OBJECTS_PER_CHUNK) return 0;
+  if((uintptr_t)((char *)object - (char *)chunk->objects) % sizeof(Object) != 0) return 0;
+  int index = (int)(object - chunk->objects);
+  return (chunk->live[index / 64] >> (index % 64)) & 1;
+}
+
+/* Check that the heap is the way the collectors think it is, and return
+   how many problems there are, describing the first few on stderr:
+
+   - every slot in the chunks is in use, on the free list or still to be
+     bump allocated, and the counts agree with the bitmaps
+   - no mark bits are left over once a collection has swept past them
+   - everything reachable from the roots is an object that's in use, with
+     an old object pointing into the nursery only if it's remembered
+   - the remembered set, the weak references, the allocation sampler and
+     the large object space only hold objects that are in use.
+
+   It goes through the whole heap, so it's for tests and `make debug`
+   builds, which call it after every collection. Call it between
+   collections: the concurrent marker could be setting mark bits while it
+   looks at them otherwise. */
+int verifyHeap(VM* vm) {
+  int problems = 0;
+  Chunk** chunks = (Chunk **)malloc(sizeof(Chunk*) * (vm->numChunks + 1));
+  assert(chunks != NULL); // Out of memory
+  if(vm->numChunks > 0) memcpy(chunks, vm->chunks, sizeof(Chunk*) * vm->numChunks);
+  qsort(chunks, (size_t)vm->numChunks, sizeof(Chunk*), compareChunks);
+
+  if(vm->collector == COLLECTOR_COPYING) {
+    if(vm->numObjects != vm->spaceUsed) {
+      heapProblem(&problems, "%d objects, but %d slots of the space used", vm->numObjects, vm->spaceUsed);
+    }
+  } else {
+    long live = 0;
+    long young = 0;
+    for(int i = 0; i < vm->numChunks; i++) {
+      Chunk* chunk = vm->chunks[i];
+      int staleMarks = 0;
+      for(int w = 0; w < MARK_WORDS; w++) {
+        live += __builtin_popcountll(chunk->live[w]);
+        young += __builtin_popcountll(chunk->young[w]);
+        if(chunk->young[w] & ~chunk->live[w]) {
+          heapProblem(&problems, "chunk %p has young slots that aren't in use", (void *)chunk);
+        }
+        if(chunk->marks[w] && !vm->marking && !chunk->needsSweep) staleMarks = 1;
+      }
+      if(staleMarks) heapProblem(&problems, "chunk %p has been swept but still has marks", (void *)chunk);
+    }
+
+    for(int i = 1; i < vm->numChunks; i++) {
+      if(vm->chunks[i - 1] >= vm->chunks[i]) {
+        heapProblem(&problems, "chunk %p is out of address order", (void *)vm->chunks[i]);
+      }
+    }
+
+    long freeSlots = 0;
+    long slots = (long)vm->numChunks * OBJECTS_PER_CHUNK;
+    for(Object* object = vm->freeList; object; object = object->next) {
+      if(object->next == NULL && object != vm->freeListTail) {
+        heapProblem(&problems, "free list ends at %p, but its tail is %p", (void *)object, (void *)vm->freeListTail);
+      }
+      Chunk* chunk = chunkFor(object);
+      if(!bsearch(&chunk, chunks, (size_t)vm->numChunks, sizeof(Chunk*), compareChunks)) {
+        heapProblem(&problems, "free list slot %p isn't in one of our chunks", (void *)object);
+        break;
+      }
+      if(isHeapObject(vm, chunks, object)) {
+        heapProblem(&problems, "free list slot %p is in use", (void *)object);
+      }
+      if(++freeSlots > slots) {
+        heapProblem(&problems, "free list goes round in circles");
+        break;
+      }
+    }
+
+    if(!vm->sweeping) {
+      long bump = vm->bumpEnd - vm->bump;
+      if(live != vm->numObjects) {
+        heapProblem(&problems, "%d objects, but %ld slots in use", vm->numObjects, live);
+      }
+      if(young != vm->numYoung) {
+        heapProblem(&problems, "%d young objects, but %ld slots are young", vm->numYoung, young);
+      }
+      if(live + freeSlots + bump != slots) {
+        heapProblem(&problems, "%ld slots in use, %ld free and %ld to bump allocate, but %ld in all",
+          live, freeSlots, bump, slots);
+      }
+    }
+  }
+
+  /* Walk everything reachable, flagging what we've seen. */
+  int capacity = vm->stackSize + (vm->clearedCount - vm->clearedNext) + 64;
+  Object** work = (Object **)malloc(sizeof(Object*) * capacity);
+  Object** seen = NULL;
+  int numSeen = 0;
+  int seenCapacity = 0;
+  assert(work != NULL); // Out of memory
+  int count = 0;
+  for(int i = 0; i < vm->stackSize + vm->clearedCount - vm->clearedNext; i++) {
+    Value root = i < vm->stackSize ? vm->stack[i] : vm->cleared[vm->clearedNext + i - vm->stackSize];
+    if(isObject(root)) work[count++] = asObject(root);
+  }
+  while(count > 0) {
+    Object* object = work[--count];
+    if(inSnapshot(vm, object)) continue;
+    if(isInterned(vm, object)) {
+      /* Interned pairs only point at immortal objects, so there's no need
+         to go any further. */
+      if(!isMarked(object)) heapProblem(&problems, "interned pair %p isn't marked", (void *)object);
+      continue;
+    }
+    if(!isHeapObject(vm, chunks, object)) {
+      heapProblem(&problems, "reachable object %p isn't in use", (void *)object);
+      continue;
+    }
+    if(object->flags & OBJECT_VERIFIED) continue;
+    object->flags |= OBJECT_VERIFIED;
+    if(numSeen == seenCapacity) {
+      seenCapacity = seenCapacity ? seenCapacity * 2 : GRAY_STACK_INITIAL;
+      seen = (Object **)realloc(seen, sizeof(Object*) * seenCapacity);
+      assert(seen != NULL); // Out of memory
+    }
+    seen[numSeen++] = object;
+
+    if(object->type > OBJ_WEAK) {
+      heapProblem(&problems, "object %p has type %d", (void *)object, object->type);
+      continue;
+    }
+    if(object->flags & OBJECT_FORWARDED) {
+      heapProblem(&problems, "object %p is a forwarding pointer", (void *)object);
+      continue;
+    }
+    if((object->type == OBJ_ARRAY || object->type == OBJ_BYTES) && object->large &&
+       object->large->owner != object) {
+      heapProblem(&problems, "object %p's payload belongs to %p", (void *)object, (void *)object->large->owner);
+      continue;
+    }
+    if(vm->collector == COLLECTOR_MARK_SWEEP) {
+      Chunk* chunk = chunkFor(object);
+      int index = (int)(object - chunk->objects);
+      if((int)((chunk->young[index / 64] >> (index % 64)) & 1) != isYoung(object)) {
+        heapProblem(&problems, "object %p's young bit doesn't match its flags", (void *)object);
+      }
+      if(vm->generational && !vm->marking && !vm->sweeping && !isYoung(object) &&
+         pointsAtYoung(object) && !(object->flags & OBJECT_REMEMBERED)) {
+        heapProblem(&problems, "old object %p points into the nursery but isn't remembered", (void *)object);
+      }
+    }
+
+    size_t fieldCount;
+    Value* fields = objectFields(object, &fieldCount);
+    for(size_t i = 0; i < fieldCount; i++) {
+      if(!isObject(fields[i])) continue;
+      if(count == capacity) {
+        capacity *= 2;
+        work = (Object **)realloc(work, sizeof(Object*) * capacity);
+        assert(work != NULL); // Out of memory
+      }
+      work[count++] = asObject(fields[i]);
+    }
+  }
+  for(int i = 0; i < numSeen; i++) {
+    seen[i]->flags &= ~OBJECT_VERIFIED;
+  }
+  free(seen);
+  free(work);
+
+  /* The collectors' own lists of objects. */
+  for(size_t i = 0; i < vm->internedCapacity; i++) {
+    Object* object = vm->interned[i];
+    if(object == NULL) continue;
+    if(!isInterned(vm, object) || !(object->flags & OBJECT_INTERNED)) {
+      heapProblem(&problems, "intern table entry %p isn't an interned pair", (void *)object);
+    } else if(internSlot(vm->interned, vm->internedCapacity, object->head, object->tail) != i) {
+      heapProblem(&problems, "interned pair %p isn't where its hash says", (void *)object);
+    }
+  }
+  for(int i = 0; i < vm->rememberedCount; i++) {
+    if(!isHeapObject(vm, chunks, vm->remembered[i])) {
+      heapProblem(&problems, "remembered object %p isn't in use", (void *)vm->remembered[i]);
+    }
+  }
+  for(int i = 0; i < vm->weakCount; i++) {
+    Object* weak = vm->weakRefs[i];
+    if(!isHeapObject(vm, chunks, weak) || weak->type != OBJ_WEAK) {
+      heapProblem(&problems, "weak reference %p isn't in use", (void *)weak);
+    } else if(!isHeapObject(vm, chunks, asObject(weak->head))) {
+      heapProblem(&problems, "weak reference %p's target %p isn't in use", (void *)weak, (void *)weak->head);
+    }
+  }
+  for(int i = 0; i < vm->numSamples; i++) {
+    if(!isHeapObject(vm, chunks, vm->samples[i].object)) {
+      heapProblem(&problems, "sampled object %p isn't in use", (void *)vm->samples[i].object);
+    }
+  }
+  long largeBytes = 0;
+  for(LargeObject* large = vm->largeObjects; large; large = large->next) {
+    largeBytes += (long)large->size;
+    if(!isHeapObject(vm, chunks, large->owner) || large->owner->large != large) {
+      heapProblem(&problems, "payload %p's owner %p isn't in use", (void *)large, (void *)large->owner);
+    }
+  }
+  if(largeBytes != vm->largeBytes) {
+    heapProblem(&problems, "large object space holds %ld bytes, but we think it's %ld", largeBytes, vm->largeBytes);
+  }
+
+  free(chunks);
+  if(problems > 10) fprintf(stderr, "verifyHeap: ...and %d more\n", problems - 10);
+  return problems;
+}
+
+/* Wrap up once every chunk has been swept. The object counts only get
+   updated here, once, rather than for every object freed. */
+void finishSweep(VM* vm) {
+  SweepState* state = &vm->sweepState;
+  vm->sweeping = 0;
+  vm->numObjects -= state->freed;
+  vm->numYoung -= state->youngGone;
+  for(int i = 0; i < state->promotedCount; i++) {
+    Object* object = state->promoted[i];
+    if(vm->pretenure && object->site) vm->sites[object->site - 1].promoted++;
+    if(object->type != OBJ_BYTES) remember(vm, object);
+  }
+  if(vm->pretenure) decidePretenuring(vm);
+  pruneRemembered(vm, 0);
+  releaseEmptyChunks(vm);
+  TRACE(1, "\tSwept %d objects, freed %d.\n", state->swept, state->freed);
+  int swept = state->swept;
+  int freed = state->freed;
+  state->swept = 0;
+  state->freed = 0;
+  state->youngGone = 0;
+  state->promotedCount = 0;
+  VERIFY_HEAP(vm);
+
+  if(!vm->sweepingFull) {
+    finishCycle(vm, swept, freed);
+    TRACE(1, "Minor GC completed, %d young and %d old objects.\n\n",
+      vm->numYoung, vm->numObjects - vm->numYoung);
+    return;
+  }
+
+  /* Now that we know what survived, work out when to collect next. */
+  setNextGC(vm, vm->generational ? oldBytes(vm) : heapBytes(vm));
+  finishCycle(vm, swept, freed);
+  if(vm->generational) {
+    TRACE(1, "GC completed, Total objects now %d. Full GC at %ld old bytes.\n\n", vm->numObjects, vm->maxBytes);
+  } else {
+    TRACE(1, "GC completed, Total objects now %d. Threshold is %ld bytes.\n\n", vm->numObjects, vm->maxBytes);
+  }
+}
+
+/* Sweep at least budget objects' worth of chunks, a whole chunk at a time.
+   Returns whether there's more to do. */
+int sweepSome(VM* vm, int budget) {
+  pauseBegin(vm);
+  long start = nanoTime();
+  while(budget > 0 && vm->sweepCursor < vm->numChunks) {
+    Chunk* chunk = vm->chunks[vm->sweepCursor++];
+    if(!chunk->needsSweep) continue;
+    sweepChunk(vm, chunk, vm->sweepingFull, &vm->sweepState);
+    budget -= OBJECTS_PER_CHUNK;
+  }
+  spliceFreeList(vm, &vm->sweepState);
+  vm->cycle.sweepNanos += nanoTime() - start;
+
+  int more = 1;
+  if(vm->sweepCursor == vm->numChunks) {
+    finishSweep(vm);
+    more = 0;
+  }
+  pauseEnd(vm);
+  return more;
+}
+
+/* What each sweeping thread runs. Each one gets a stretch of the chunks
+   that are left, the lowest to thread 0, so that putting their free lists
+   together in thread order keeps the VM's in address order. Chunks cost
+   about the same to sweep, so there's not much to gain from handing them
+   out one at a time. */
+void parallelSweepJob(VM* vm, int id) {
+  GCWorker* worker = &vm->workers[id];
+  long left = vm->numChunks - vm->sweepCursor;
+  int start = vm->sweepCursor + (int)(left * id / vm->gcThreads);
+  int end = vm->sweepCursor + (int)(left * (id + 1) / vm->gcThreads);
+  for(int index = start; index < end; index++) {
+    Chunk* chunk = vm->chunks[index];
+    if(chunk->needsSweep) {
+      sweepChunk(vm, chunk, vm->sweepingFull, &worker->sweep);
+    }
+  }
+}
+
+/* Sweep everything that's left to sweep, with all the GC threads if we have
+   them. */
+void sweep(VM* vm) {
+  if(!vm->sweeping) return;
+
+  if(vm->gcThreads > 1) {
+    long start = nanoTime();
+    runParallel(vm, parallelSweepJob);
+    vm->sweepCursor = vm->numChunks;
+    for(int i = 0; i < vm->gcThreads; i++) {
+      mergeSweepState(vm, &vm->workers[i].sweep);
+    }
+    vm->cycle.sweepNanos += nanoTime() - start;
+  }
+  sweepSome(vm, INT_MAX);
+}
+
+/* The most objects a copying collector's space can hold without going over
+   heapLimitBytes, not counting the large object space. */
+int spaceLimit(VM* vm) {
+  if(vm->heapLimitBytes == 0) return INT_MAX;
+  long limit = (vm->heapLimitBytes - vm->largeBytes) / (long)sizeof(Object);
+  return limit > INT_MAX ? INT_MAX : (int)limit;
+}
+
+/* Copy an object into to-space, unless it's already been copied, and
+   return where it lives now. Ints, snapshots and interned pairs are left as
+   they are. The old copy is left behind with its head pointing at the new
+   one so anything else pointing at it can find it. */
+Value forward(VM* vm, Value value, Object* toSpace, int* toUsed) {
+  if(!isObject(value)) return value;
+  Object* object = asObject(value);
+  if(isImmortal(vm, object)) return value;
+  if(object->flags & OBJECT_FORWARDED) return object->head;
+
+  Object* copy = &toSpace[(*toUsed)++];
+  *copy = *object;
+  object->flags |= OBJECT_FORWARDED;
+  object->head = objectValue(copy);
+  return object->head;
+}
+
+/* Copy everything reachable from the stack into a new space with room for
+   capacity objects and make that the space we allocate from. This is
+   Cheney's algorithm: to-space itself is the queue of objects whose fields
+   still need fixing up, so there's no gray stack and no recursion, and the
+   work depends only on how much is alive. */
+void evacuate(VM* vm, int capacity) {
+  Object* toSpace = (Object *)malloc(sizeof(Object) * capacity);
+  assert(toSpace != NULL); // Out of memory
+  int toUsed = 0;
+
+  /* Copy the roots, pointing the stack and the cleared queue at the
+     copies. */
+  for(int i = 0; i < vm->stackSize; i++) {
+    vm->stack[i] = forward(vm, vm->stack[i], toSpace, &toUsed);
+  }
+  for(int i = vm->clearedNext; i < vm->clearedCount; i++) {
+    vm->cleared[i] = forward(vm, vm->cleared[i], toSpace, &toUsed);
+  }
+
+  /* Walk to-space, copying whatever the pairs there point at onto the end
+     and fixing up their fields. When we catch up with the end we're done. */
+  for(int scan = 0; scan < toUsed; scan++) {
+    size_t count;
+    Value* fields = objectFields(&toSpace[scan], &count);
+    for(size_t i = 0; i < count; i++) {
+      fields[i] = forward(vm, fields[i], toSpace, &toUsed);
+    }
+  }
+
+  /* An array's elements are fixed up where they are, the payload doesn't
+     move. The payloads whose owners we copied are still alive, and need
+     telling where their owners went. The rest are garbage. */
+  LargeObject** link = &vm->largeObjects;
+  while(*link) {
+    LargeObject* large = *link;
+    if(large->owner->flags & OBJECT_FORWARDED) {
+      large->owner = asObject(large->owner->head);
+      link = &large->next;
+    } else {
+      *link = large->next;
+      freeLarge(vm, large);
+    }
+  }
+
+  /* A weak reference that got copied is alive, and so is its target if
+     that got copied too. If it didn't, the reference is cleared. Either
+     way the copy still has the old target in its head, scanning it left
+     that alone. */
+  int kept = 0;
+  for(int i = 0; i < vm->weakCount; i++) {
+    Object* weak = vm->weakRefs[i];
+    if(!(weak->flags & OBJECT_FORWARDED)) continue;
+    weak = asObject(weak->head);
+    Object* target = asObject(weak->head);
+    if(target->flags & OBJECT_FORWARDED) {
+      weak->head = target->head;
+      vm->weakRefs[kept++] = weak;
+    } else {
+      weak->head = NIL_VALUE;
+      if(weak->tail != NIL_VALUE) enqueueCleared(vm, weak->tail);
+    }
+  }
+  vm->weakCount = kept;
+
+  /* And the allocation sampler's objects are alive if they got copied. */
+  for(int i = 0; i < vm->numSites; i++) {
+    vm->sites[i].survivingBytes = 0;
+  }
+  kept = 0;
+  for(int i = 0; i < vm->numSamples; i++) {
+    Sample sample = vm->samples[i];
+    if(!(sample.object->flags & OBJECT_FORWARDED)) continue;
+    sample.object = asObject(sample.object->head);
+    vm->sites[sample.site].survivingBytes += objectBytes(sample.object) * vm->sampleRate;
+    vm->samples[kept++] = sample;
+  }
+  vm->numSamples = kept;
+
+  TRACE(1, "\tCopied %d live objects, left %d behind.\n", toUsed, vm->spaceUsed - toUsed);
+  free(vm->fromSpace);
+  vm->fromSpace = toSpace;
+  vm->spaceCapacity = capacity;
+  vm->spaceUsed = toUsed;
+  vm->numObjects = toUsed;
+}
+
+/* The generational collector's write barrier: an old object picking up a
+   pointer to a young one lands in the remembered set, otherwise a minor
+   collection would never see that pointer. */
+void generationalBarrier(VM* vm, Object* object, Value old, Value value) {
+  (void)old;
+  if(!isYoung(object) && isYoungValue(value)) remember(vm, object);
+}
+
+/* The write barrier while an incremental collection is marking. The
+   object being overwritten might have been reachable when marking
+   started, and this might be the last path to it that marking hasn't
+   looked at yet. Shading it keeps our snapshot intact (this is Yuasa's
+   deletion barrier). Then whatever the collector needs anyway. */
+void incrementalBarrier(VM* vm, Object* object, Value old, Value value) {
+  mark(vm, old);
+  if(vm->ops->writeBarrier) vm->ops->writeBarrier(vm, object, old, value);
+}
+
+/* Start an incremental collection. All we do right away is mark the roots,
+   which takes a snapshot of what's reachable right now: everything in that
+   snapshot will be marked by the time we're done, thanks to setHead() and
+   setTail() shading whatever they overwrite. Anything allocated after this
+   is born marked. */
+void startMarking(VM* vm) {
+  /* The marks from the last collection have to be swept up first. */
+  sweep(vm);
+  TRACE(1, "\nStarting incremental GC\n");
+  TRACE(1, "\tMarking %d objects\n", vm->stackSize);
+  startCycle(vm, 1);
+  long start = nanoTime();
+  vm->marking = 1;
+  vm->barrier = incrementalBarrier;
+  vm->numMarked = 0;
+  for(int i = 0; i < vm->stackSize; i++) {
+    mark(vm, vm->stack[i]);
+  }
+  vm->markNanos = nanoTime() - start;
+}
+
+/* Once there's nothing gray left everything that's going to be marked is
+   marked, so the sweeping can begin. */
+void finishMarking(VM* vm) {
+  vm->marking = 0;
+  vm->barrier = vm->ops->writeBarrier;
+  processWeakRefs(vm);
+  processSamples(vm);
+  TRACE(1, "\tMarked %d reachable objects in %ldns (%.1fns per object)\n",
+    vm->numMarked, vm->markNanos,
+    vm->numMarked ? (double)vm->markNanos / vm->numMarked : 0.0);
+  pruneRemembered(vm, 1);
+  startSweep(vm, 1);
+  if(vm->lazySweep) {
+    TRACE(1, "Incremental marking completed, sweeping %d objects lazily.\n\n", vm->numObjects);
+  } else {
+    sweep(vm);
+  }
+}
+
+/* Do up to budget objects' worth of incremental marking, starting a new
+   collection if there isn't one going. Returns whether there's still
+   marking left to do. */
+int gcStep(VM* vm, int budget) {
+  assert(vm->collector == COLLECTOR_MARK_SWEEP);
+  pauseBegin(vm);
+  if(!vm->marking) {
+    startMarking(vm);
+  }
+
+  long start = nanoTime();
+  while(budget-- > 0 && vm->grayCount > 0) {
+    traceOne(vm);
+  }
+  vm->markNanos += nanoTime() - start;
+
+  int more = 1;
+  if(vm->grayCount == 0) {
+    finishMarking(vm);
+    more = 0;
+  }
+  pauseEnd(vm);
+  return more;
+}
+
+/* The incremental collector's completeMarking(): the rest of the marking,
+   all in one go. */
+void finishIncrementalMark(VM* vm) {
+  while(vm->marking) {
+    gcStep(vm, INT_MAX);
+  }
+}
+
+/* Hand the objects the barriers have shaded over to the marker and make
+   sure it's awake to deal with them. */
+void flushSatb(VM* vm) {
+  pthread_mutex_lock(&vm->markerLock);
+  if(vm->satbQueueCount + vm->satbBufferCount > vm->satbQueueCapacity) {
+    while(vm->satbQueueCount + vm->satbBufferCount > vm->satbQueueCapacity) {
+      vm->satbQueueCapacity = vm->satbQueueCapacity ? vm->satbQueueCapacity * 2 : SATB_BUFFER_SIZE;
+    }
+    vm->satbQueue = (Object **)realloc(vm->satbQueue, sizeof(Object*) * vm->satbQueueCapacity);
+    assert(vm->satbQueue != NULL); // Out of memory
+  }
+  memcpy(vm->satbQueue + vm->satbQueueCount, vm->satbBuffer, sizeof(Object*) * vm->satbBufferCount);
+  vm->satbQueueCount += vm->satbBufferCount;
+  vm->satbBufferCount = 0;
+  atomic_store(&vm->markerIdle, 0);
+  pthread_cond_signal(&vm->markerWake);
+  pthread_mutex_unlock(&vm->markerLock);
+}
+
+/* The barriers' version of mark() while a concurrent collection is
+   marking: the marker does the marking, we just tell it what to mark. */
+void satbShade(VM* vm, Value value) {
+  if(!isObject(value)) return;
+  Object* object = asObject(value);
+  if(inSnapshot(vm, object)) return;
+  if(vm->satbBufferCount == SATB_BUFFER_SIZE) flushSatb(vm);
+  vm->satbBuffer[vm->satbBufferCount++] = object;
+}
+
+/* The write barrier while a concurrent collection is marking, which is
+   incrementalBarrier() but with the marker doing the marking. */
+void concurrentBarrier(VM* vm, Object* object, Value old, Value value) {
+  satbShade(vm, old);
+  if(vm->ops->writeBarrier) vm->ops->writeBarrier(vm, object, old, value);
+}
+
+/* Start a concurrent collection. All this pause has to do is sweep up
+   whatever the last collection left and wake the marker, which goes
+   through the stack without us. */
+void startConcurrentMark(VM* vm) {
+  pauseBegin(vm);
+  sweep(vm);
+  TRACE(1, "\nStarting concurrent GC\n");
+  startCycle(vm, 1);
+  vm->marking = 1;
+  vm->barrier = concurrentBarrier;
+  pthread_mutex_lock(&vm->markerLock);
+  vm->markerMarked = 0;
+  vm->markerNanos = 0;
+  vm->markerScanStack = 1;
+  atomic_store(&vm->markerIdle, 0);
+  pthread_cond_signal(&vm->markerWake);
+  pthread_mutex_unlock(&vm->markerLock);
+  pauseEnd(vm);
+}
+
+/* The final pause of a concurrent collection. Once the marker's done with
+   what it has, we hold on to its lock so it stays put, and finish up
+   ourselves: shade what's in our barrier buffer, go through the stack once
+   more, and trace from them. With the program stopped nothing more can
+   turn up, so then marking is done. The marker has usually seen nearly
+   everything by now, so this is quick however big the heap is. */
+void finishConcurrentMark(VM* vm) {
+  pauseBegin(vm);
+  pthread_mutex_lock(&vm->markerLock);
+  while(!atomic_load(&vm->markerIdle)) {
+    pthread_cond_wait(&vm->markerDone, &vm->markerLock);
+  }
+  long start = nanoTime();
+  for(int i = 0; i < vm->satbBufferCount; i++) {
+    markerShade(vm, objectValue(vm->satbBuffer[i]));
+  }
+  vm->satbBufferCount = 0;
+  markerScan(vm);
+  markerTrace(vm);
+  vm->markerNanos += nanoTime() - start;
+  vm->numMarked = vm->markerMarked;
+  vm->markNanos = vm->markerNanos;
+  pthread_mutex_unlock(&vm->markerLock);
+  finishMarking(vm);
+  pauseEnd(vm);
+}
+
+/* The copying collector's full collection, which is the only kind it
+   has. */
+void collectCopying(VM* vm) {
+  startCycle(vm, 1);
+  int before = vm->spaceUsed;
+  long start = nanoTime();
+  evacuate(vm, vm->spaceCapacity);
+  /* If more than half of the space is still full we'd be collecting
+     again in no time, so move everything into a space twice the size, or
+     as big as the heap limit allows if that's smaller. */
+  int capacity = vm->spaceCapacity > spaceLimit(vm) / 2 ? spaceLimit(vm) : vm->spaceCapacity * 2;
+  if(vm->numObjects > vm->spaceCapacity / 2 && capacity > vm->spaceCapacity) {
+    evacuate(vm, capacity);
+  }
+  vm->markNanos = nanoTime() - start;
+  vm->numMarked = vm->numObjects;
+  setNextGC(vm, vm->largeBytes);
+  finishCycle(vm, before, before - vm->numObjects);
+  VERIFY_HEAP(vm);
+  TRACE(1, "GC completed, Total objects now %d. Space holds %d.\n\n", vm->numObjects, vm->spaceCapacity);
+}
+
+/* The mark-sweep collector's full collection, generational or not. */
+void collectMarkSweep(VM* vm) {
+  /* If we're part way through an incremental or concurrent collection,
+     finish it off. Then its marks have to be swept up, like the last
+     collection's, before we can start marking again. */
+  if(vm->marking) vm->ops->completeMarking(vm);
+  sweep(vm);
+  startCycle(vm, 1);
+
+  /* Mark… */
+  markAll(vm);
+  processWeakRefs(vm);
+  processSamples(vm);
+  /* Old pairs in the remembered set might be about to be freed. */
+  pruneRemembered(vm, 1);
+  /* Sweep! Or leave it to newObject() to do a bit at a time. */
+  startSweep(vm, 1);
+  if(vm->lazySweep) {
+    TRACE(1, "Marking completed, sweeping %d objects lazily.\n\n", vm->numObjects);
+  } else {
+    sweep(vm);
+  }
+}
+
+/* Perform a garbage collection. */
+void gc(VM* vm) {
+  TRACE(1, "\nEntering GC\n");
+  pauseBegin(vm);
+  vm->ops->collect(vm);
+  pauseEnd(vm);
+}
+
+/* Collect just the nursery. Old objects are taken to be alive, and their
+   pointers into the nursery come from the remembered set. */
+void minorGC(VM* vm) {
+  TRACE(1, "\nEntering minor GC\n");
+  pauseBegin(vm);
+  sweep(vm);
+  startCycle(vm, 0);
+  vm->collectingYoung = 1;
+  markAll(vm);
+  processWeakRefs(vm);
+  processSamples(vm);
+  vm->collectingYoung = 0;
+  startSweep(vm, 0);
+  if(vm->lazySweep) {
+    TRACE(1, "Marking completed, sweeping %d young objects lazily.\n\n", vm->numYoung);
+  } else {
+    sweep(vm);
+  }
+  pauseEnd(vm);
+}
+
+/* Every store into a pair's fields or an array's elements calls this first,
+   with what the field held and what's about to go in it, and it hands
+   them on to whichever barrier the collector has in place right now (see
+   generationalBarrier(), incrementalBarrier() and concurrentBarrier()).
+   Most of the time, for most collectors, that's none at all. Checking
+   that the object isn't immortal means looking through the snapshots on
+   every store, so only debug builds do it. Snapshots and frozen regions
+   are read-only pages either way, but a store into an interned pair goes
+   unnoticed otherwise. */
+void writeBarrier(VM* vm, Object* object, Value old, Value value) {
+#ifdef BABYVM_DEBUG
+  assert(!isImmortal(vm, object)); // Snapshots, frozen and interned pairs are read-only
+#endif
+  if(vm->barrier) vm->barrier(vm, object, old, value);
+}
+
+/* The stores are atomic because the concurrent marker might be reading
+   the field at the same time. They're plain stores on anything we care
+   about. */
+void setHead(VM* vm, Object* pair, Value value) {
+  assert(pair->type == OBJ_PAIR);
+  writeBarrier(vm, pair, pair->head, value);
+  __atomic_store_n(&pair->head, value, __ATOMIC_RELEASE);
+}
+
+void setTail(VM* vm, Object* pair, Value value) {
+  assert(pair->type == OBJ_PAIR);
+  writeBarrier(vm, pair, pair->tail, value);
+  __atomic_store_n(&pair->tail, value, __ATOMIC_RELEASE);
+}
+
+/* Make sure there's room on the stack for one more object, committing
+   more of it if we have to. Returns whether there is. */
+int stackHasRoom(VM* vm) {
+  if(vm->stackSize < vm->stackCommitted) return 1;
+  if(vm->stackCommitted == vm->stackLimit) return 0;
+
+  int more = STACK_COMMIT / sizeof(Value);
+  if(more > vm->stackLimit - vm->stackCommitted) more = vm->stackLimit - vm->stackCommitted;
+  /* The kernel rounds this out to whole pages, same as it did the
+     reservation, so the last few entries are fine too. */
+  size_t length = sizeof(Value) * (size_t)(vm->stackCommitted + more);
+  int result = mprotect(vm->stack, length, PROT_READ | PROT_WRITE);
+  assert(result == 0); // Out of memory
+  (void)result;
+  vm->stackCommitted += more;
+  TRACE(1, "Grew the stack to %d entries.\n", vm->stackCommitted);
+  return 1;
+}
+
+/* Function for adding an object from the stack. */
+VMStatus push(VM* vm, Value value) {
+  if(!stackHasRoom(vm)) return VM_STACK_OVERFLOW;
+  /* The concurrent marker reads the stack as we go, so the entry has to be
+     there before stackSize says it is. */
+  __atomic_store_n(&vm->stack[vm->stackSize], value, __ATOMIC_RELAXED);
+  __atomic_store_n(&vm->stackSize, vm->stackSize + 1, __ATOMIC_RELEASE);
+  TRACE(2, "Adding object to stack, size is now %d.\n", vm->stackSize);
+  return VM_OK;
+}
+
+/* Called with anything that comes off the stack. It might still have been
+   on the stack when the concurrent marker started, so it gets the same
+   treatment as an overwritten field. */
+void stackBarrier(VM* vm, Value value) {
+  if(vm->marking && vm->ops->stackBarrier) vm->ops->stackBarrier(vm, value);
+}
+
+/* Function for removing an object from the stack. */
+Value pop(VM* vm) {
+  assert(vm->stackSize > 0); // Stack underflow
+  Value value = vm->stack[vm->stackSize - 1];
+  __atomic_store_n(&vm->stackSize, vm->stackSize - 1, __ATOMIC_RELAXED);
+  stackBarrier(vm, value);
+  return value;
+}
+
+/* How much of some per-object amount of work to do for count objects. */
+int workFor(int perObject, int count) {
+  return count > INT_MAX / perObject ? INT_MAX : perObject * count;
+}
+
+/* The copying collector's objects take up its space. */
+long footprintCopying(VM* vm) {
+  return (long)vm->spaceCapacity * (long)sizeof(Object);
+}
+
+/* The mark-sweep collector's take up its chunks. */
+long footprintInChunks(VM* vm) {
+  return (long)vm->numChunks * CHUNK_SIZE;
+}
+
+/* The copying collector needs a bigger space if count more objects don't
+   fit in this one. */
+long growthCopying(VM* vm, int count) {
+  if(vm->spaceCapacity - vm->spaceUsed >= count) return 0;
+  return (long)(vm->numObjects + count - vm->spaceCapacity) * (long)sizeof(Object);
+}
+
+/* The mark-sweep collector needs more chunks if count more objects don't
+   fit in the slots it's got spare. While a sweep's under way the garbage
+   it hasn't got to yet counts, so this might be a little pessimistic. */
+long growthInChunks(VM* vm, int count) {
+  long spare = (long)vm->numChunks * OBJECTS_PER_CHUNK - vm->numObjects;
+  if(spare >= count) return 0;
+  return (count - spare + OBJECTS_PER_CHUNK - 1) / OBJECTS_PER_CHUNK * (long)CHUNK_SIZE;
+}
+
+/* How much memory the heap takes up, whether or not there's anything in
+   it. */
+long footprintBytes(VM* vm) {
+  return (long)vm->numInternChunks * CHUNK_SIZE + vm->largeBytes + vm->ops->footprint(vm);
+}
+
+/* Whether there's room for count more objects and payloadBytes more of the
+   large object space without the heap going over heapLimitBytes. */
+int heapHasRoom(VM* vm, int count, long payloadBytes) {
+  if(vm->heapLimitBytes == 0) return 1;
+  long growth = payloadBytes + vm->ops->growth(vm, count);
+  return footprintBytes(vm) + growth <= vm->heapLimitBytes;
+}
+
+/* Make sure the heap can take count more objects and payloadBytes more of
+   the large object space without going over its limit. If it can't, a
+   full collection, finished there and then, might make room, and if even
+   that doesn't we're out of memory. */
+void reserveHeap(VM* vm, int count, long payloadBytes) {
+  if(heapHasRoom(vm, count, payloadBytes)) return;
+  TRACE(1, "Heap limit of %ld bytes reached, full GC needed\n", vm->heapLimitBytes);
+  gc(vm);
+  sweep(vm);
+  assert(heapHasRoom(vm, count, payloadBytes)); // Out of memory
+}
+
+/* Where every collectIfNeeded() starts: if there's sweeping left over
+   from the last collection, do a bit more, as much as count separate
+   allocations would have done. Returns whether there's still some left,
+   in which case the counts won't be right until it's done, and we can't
+   collect again until then anyway. */
+int sweepingLeft(VM* vm, int count) {
+  if(!vm->sweeping) return 0;
+  if(!sweepSome(vm, workFor(vm->sweepBatch, count))) return 0;
+  TRACE(2, "Still sweeping, GC not needed\n");
+  return 1;
+}
+
+/* The mark-sweep collector's collectIfNeeded(), which the lazy-sweep,
+   parallel and adaptive ones share: if the heap has grown to the
+   threshold, run the garbage collector. */
+void collectIfNeededInChunks(VM* vm, int count) {
+  if(sweepingLeft(vm, count)) return;
+  TRACE(2, "Checking for GC: %ld bytes in heap >= %ld max bytes\n", heapBytes(vm), vm->maxBytes);
+  if(heapBytes(vm) >= vm->maxBytes) {
+    TRACE(1, "GC needed\n");
+    gc(vm);
+  } else {
+    TRACE(2, "GC not needed\n");
+  }
+}
+
+/* The generational collector's: collect the nursery once it's full, and
+   everything if the old generation has outgrown its threshold. */
+void collectIfNeededGenerational(VM* vm, int count) {
+  if(sweepingLeft(vm, count)) return;
+  TRACE(2, "Checking for GC: %d young objects >= %d nursery size\n", vm->numYoung, vm->nurserySize);
+  if(vm->numYoung >= vm->nurserySize) {
+    if(oldBytes(vm) >= vm->maxBytes) {
+      TRACE(1, "Full GC needed\n");
+      gc(vm);
+    } else {
+      TRACE(1, "Minor GC needed\n");
+      minorGC(vm);
+    }
+  } else {
+    TRACE(2, "GC not needed\n");
+  }
+}
+
+/* The incremental collector's: pay for the allocations with a bit of
+   marking, or start marking once the heap has grown to the threshold. */
+void collectIfNeededIncremental(VM* vm, int count) {
+  if(sweepingLeft(vm, count)) return;
+  if(vm->marking) {
+    TRACE(2, "Still marking, doing %d objects' worth\n", workFor(vm->markRate, count));
+    gcStep(vm, workFor(vm->markRate, count));
+  } else if(heapBytes(vm) >= vm->maxBytes) {
+    TRACE(1, "GC needed, starting incremental GC\n");
+    gcStep(vm, vm->markRate);
+  } else {
+    TRACE(2, "GC not needed\n");
+  }
+}
+
+/* The concurrent collector's: the marker's doing the work, so once it's
+   run out, or if we're getting too far ahead of it, stop and finish up.
+   Otherwise set it going once the heap has grown to the threshold. */
+void collectIfNeededConcurrent(VM* vm, int count) {
+  if(sweepingLeft(vm, count)) return;
+  if(vm->marking) {
+    TRACE(2, "Still marking concurrently\n");
+    if(atomic_load(&vm->markerIdle) || heapBytes(vm) >= 2 * vm->maxBytes) {
+      TRACE(1, "Finishing concurrent GC\n");
+      finishConcurrentMark(vm);
+    }
+  } else if(heapBytes(vm) >= vm->maxBytes) {
+    TRACE(1, "GC needed, starting concurrent GC\n");
+    startConcurrentMark(vm);
+  } else {
+    TRACE(2, "GC not needed\n");
+  }
+}
+
+/* Take n slots side by side in memory for newObjects(), or return NULL if
+   that would mean growing the heap when takeSlot() wouldn't have to.
+
+   The front of the free list is often a run like that already, since
+   sweeping puts each chunk's garbage on it in address order. Otherwise the
+   chunk we're bump allocating from might have room. If neither does, but
+   there aren't n slots free anywhere, takeSlot() would be growing the pool
+   anyway, so we might as well start a fresh chunk now. What we don't do is
+   grow the pool while there's room elsewhere, since that way the heap
+   grows without the collector ever hearing about it. While a sweep's
+   under way it's anybody's guess how much room it'll find, so then we
+   leave it to takeSlot(). */
+Object* takeRun(VM* vm, int n) {
+  Object* run = vm->freeList;
+  if(run) {
+    Object* end = run;
+    int length = 1;
+    while(length < n && end->next == end + 1) {
+      end = end->next;
+      length++;
+    }
+    if(length == n) {
+      vm->freeList = end->next;
+      return run;
+    }
+  }
+
+  long freeSlots = (long)vm->numChunks * OBJECTS_PER_CHUNK - vm->numObjects - (vm->bumpEnd - vm->bump);
+  if(vm->bumpEnd - vm->bump < n) {
+    if(n > OBJECTS_PER_CHUNK || vm->sweeping || freeSlots >= n) return NULL;
+    growPool(vm);
+  }
+  run = vm->bump;
+  vm->bump += n;
+  return run;
+}
+
+/* Take a slot for a new object. If the free list has run dry, sweeping
+   might find one, otherwise we bump allocate, and make the pool bigger if
+   that's run out too. */
+Object* takeSlot(VM* vm) {
+  while(vm->freeList == NULL && vm->sweeping) {
+    sweepSome(vm, vm->sweepBatch);
+  }
+  Object* object;
+  if(vm->freeList) {
+    object = vm->freeList;
+    vm->freeList = object->next;
+  } else {
+    if(vm->bump == vm->bumpEnd) growPool(vm);
+    object = vm->bump++;
+  }
+  return object;
+}
+
+/* Say where in the program the allocations from now on come from, for the
+   allocation sampler, and return where we were before so it can be put
+   back. Sites are told apart by the address of their name, so a string
+   literal is just the thing. */
+const char* vmSetSite(VM* vm, const char* name) {
+  const char* previous = vm->currentSite < 0 ? NULL : vm->sites[vm->currentSite].name;
+  for(int i = 0; i < vm->numSites; i++) {
+    if(vm->sites[i].name == name) {
+      vm->currentSite = i;
+      return previous;
+    }
+  }
+  assert(vm->numSites < USHRT_MAX); // Object.site is a short
+  if(vm->numSites == vm->sitesCapacity) {
+    vm->sitesCapacity = vm->sitesCapacity ? vm->sitesCapacity * 2 : 16;
+    vm->sites = (AllocationSite *)realloc(vm->sites, sizeof(AllocationSite) * vm->sitesCapacity);
+    assert(vm->sites != NULL); // Out of memory
+  }
+  vm->sites[vm->numSites].name = name;
+  vm->sites[vm->numSites].sampled = 0;
+  vm->sites[vm->numSites].survivingBytes = 0;
+  vm->sites[vm->numSites].young = 0;
+  vm->sites[vm->numSites].promoted = 0;
+  vm->sites[vm->numSites].pretenured = 0;
+  vm->sites[vm->numSites].probeCountdown = PRETENURE_PROBE;
+  vm->currentSite = vm->numSites++;
+  return previous;
+}
+
+int compareSites(const void* a, const void* b) {
+  long left = ((const AllocationSite *)a)->survivingBytes;
+  long right = ((const AllocationSite *)b)->survivingBytes;
+  return left > right ? -1 : left < right;
+}
+
+/* Print what the allocation sampler has found, the sites whose objects
+   take up the most of the heap first. */
+void printAllocationSites(VM* vm) {
+  AllocationSite* sites = (AllocationSite *)malloc(sizeof(AllocationSite) * (vm->numSites + 1));
+  assert(sites != NULL); // Out of memory
+  if(vm->numSites > 0) memcpy(sites, vm->sites, sizeof(AllocationSite) * vm->numSites);
+  qsort(sites, (size_t)vm->numSites, sizeof(AllocationSite), compareSites);
+  printf("Allocation sites, sampling 1 in %d allocations:\n", vm->sampleRate);
+  for(int i = 0; i < vm->numSites; i++) {
+    printf("  %-24s ~%ld allocations, ~%ld bytes surviving%s\n",
+      sites[i].name, sites[i].sampled * vm->sampleRate, sites[i].survivingBytes,
+      sites[i].pretenured ? ", pretenured" : "");
+  }
+  free(sites);
+}
+
+/* The allocation sampler's turn: keep an eye on this new object. */
+void sampleAllocation(VM* vm, Object* object) {
+  vm->sampleCountdown = vm->sampleRate;
+  if(vm->currentSite < 0) vmSetSite(vm, "(unnamed)");
+  if(vm->numSamples == vm->samplesCapacity) {
+    vm->samplesCapacity = vm->samplesCapacity ? vm->samplesCapacity * 2 : REMEMBERED_INITIAL;
+    vm->samples = (Sample *)realloc(vm->samples, sizeof(Sample) * vm->samplesCapacity);
+    assert(vm->samples != NULL); // Out of memory
+  }
+  vm->samples[vm->numSamples].object = object;
+  vm->samples[vm->numSamples].site = vm->currentSite;
+  vm->numSamples++;
+  vm->sites[vm->currentSite].sampled++;
+}
+
+/* Whether the next count objects, which are all allocated together, should
+   skip the nursery and be born old, because pretenuring has found that
+   objects from the current site nearly always get promoted. If they're
+   born young, the site hears about it. */
+int pretenureNext(VM* vm, int count) {
+  if(!vm->pretenure || vm->currentSite < 0) return 0;
+  AllocationSite* site = &vm->sites[vm->currentSite];
+  if(site->pretenured && --site->probeCountdown > 0) return 1;
+  site->probeCountdown = PRETENURE_PROBE;
+  site->young += count;
+  return 0;
+}
+
+/* Turn a slot takeSlot() gave us into an object of the given type, in the
+   nursery unless old is set. */
+void initObject(VM* vm, Object* object, ObjectType type, int old) {
+  /* Note in the chunk that the slot's in use, and whether the object is
+     young. */
+  Chunk* chunk = chunkFor(object);
+  int index = (int)(object - chunk->objects);
+  chunk->live[index / 64] |= (uint64_t)1 << (index % 64);
+  if(!old) chunk->young[index / 64] |= (uint64_t)1 << (index % 64);
+
+  /* Set it's type. Everything starts out with nothing in its fields so the
+     write barrier doesn't go chasing garbage. */
+  object->type = type;
+  object->age = 0;
+  object->flags = old ? OBJECT_OLD : 0;
+  object->site = (unsigned short)(vm->currentSite + 1);
+  object->head = NIL_VALUE;
+  object->tail = NIL_VALUE;
+  /* Objects allocated while marking is under way, or in a chunk we haven't
+     swept yet, are born marked so this collection won't free them. The
+     concurrent marker could be marking in the same word, so that takes
+     tryMark(). The ones waiting on a sweep are flagged as well, so that
+     the sweep doesn't take them for survivors and age them. */
+  if(vm->marking) {
+    tryMark(object);
+  } else if(vm->sweeping && chunk->needsSweep) {
+    setMarked(object);
+    object->flags |= OBJECT_UNSWEPT;
+  }
+  if(vm->sampleRate && --vm->sampleCountdown == 0) sampleAllocation(vm, object);
+
+  vm->numObjects++;
+  if(!old) vm->numYoung++;
+}
+
+/* The copying collector's newObject(). */
+Object* allocateCopying(VM* vm, ObjectType type) {
+  /* Allocation is just bumping an index. Once the space is full we
+     collect, which always leaves some room. */
+  TRACE(2, "Checking for GC: %d objects in space == %d capacity\n", vm->spaceUsed, vm->spaceCapacity);
+  if(vm->spaceUsed == vm->spaceCapacity) {
+    TRACE(1, "GC needed\n");
+    gc(vm);
+    assert(vm->spaceUsed < vm->spaceCapacity); // Out of memory
+  } else {
+    TRACE(2, "GC not needed\n");
+  }
+  Object* object = &vm->fromSpace[vm->spaceUsed++];
+  object->type = type;
+  object->age = 0;
+  object->flags = 0;
+  object->head = NIL_VALUE;
+  object->tail = NIL_VALUE;
+  vm->numObjects++;
+  if(vm->sampleRate && --vm->sampleCountdown == 0) sampleAllocation(vm, object);
+  TRACE(2, "Created object, number of objects is now %d\n", vm->numObjects);
+  return object;
+}
+
+/* The mark-sweep collector's newObject(), generational or not. */
+Object* allocateInChunks(VM* vm, ObjectType type) {
+  vm->ops->collectIfNeeded(vm, 1);
+  reserveHeap(vm, 1, 0);
+  Object* object = takeSlot(vm);
+  initObject(vm, object, type, pretenureNext(vm, 1));
+  TRACE(2, "Created object, number of objects is now %d\n", vm->numObjects);
+  /* Return the object back to our caller. */
+  return object;
+}
+
+/* The copying collector's newObjects(). */
+Object* allocateManyCopying(VM* vm, ObjectType type, int n) {
+  if(vm->spaceCapacity - vm->spaceUsed < n) {
+    TRACE(1, "GC needed\n");
+    gc(vm);
+  }
+  /* If that didn't leave room, move everything to a space that has,
+     with room to spare if the heap limit allows. */
+  if(vm->spaceCapacity - vm->spaceUsed < n) {
+    assert(n <= spaceLimit(vm) - vm->numObjects); // Out of memory
+    int capacity = vm->numObjects + n > spaceLimit(vm) / 2 ? spaceLimit(vm) : 2 * (vm->numObjects + n);
+    pauseBegin(vm);
+    evacuate(vm, capacity);
+    pauseEnd(vm);
+  }
+  Object* objects = &vm->fromSpace[vm->spaceUsed];
+  for(int i = 0; i < n; i++) {
+    objects[i].type = type;
+    objects[i].age = 0;
+    objects[i].flags = 0;
+    objects[i].head = NIL_VALUE;
+    objects[i].tail = i + 1 < n ? objectValue(&objects[i + 1]) : NIL_VALUE;
+    if(vm->sampleRate && --vm->sampleCountdown == 0) sampleAllocation(vm, &objects[i]);
+  }
+  vm->spaceUsed += n;
+  vm->numObjects += n;
+  TRACE(2, "Created %d objects, number of objects is now %d\n", n, vm->numObjects);
+  return objects;
+}
+
+/* The mark-sweep collector's newObjects(), generational or not. */
+Object* allocateManyInChunks(VM* vm, ObjectType type, int n) {
+  /* Nothing below can collect: takeSlot() might sweep, but objects born in
+     chunks still to be swept are born marked. */
+  vm->ops->collectIfNeeded(vm, n);
+  reserveHeap(vm, n, 0);
+  /* They're all born the same age, since nothing remembers the ones that
+     point at each other. */
+  int old = pretenureNext(vm, n);
+  Object* run = takeRun(vm, n);
+  Object* first = run ? run : takeSlot(vm);
+  initObject(vm, first, type, old);
+  Object* last = first;
+  for(int i = 1; i < n; i++) {
+    Object* object = run ? run + i : takeSlot(vm);
+    initObject(vm, object, type, old);
+    last->tail = objectValue(object);
+    last = object;
+  }
+  TRACE(2, "Created %d objects, number of objects is now %d\n", n, vm->numObjects);
+  return first;
+}
+
+/* The copying collector only collects when its space fills up, so it
+   keeps an eye on the large object space before anything's added to it. */
+void reserveLargeCopying(VM* vm) {
+  if(vm->largeBytes >= vm->maxBytes) {
+    TRACE(1, "GC needed for the large object space\n");
+    gc(vm);
+  }
+}
+
+/* The mark-sweep collectors all share the heap and the full collection.
+   What sets them apart is when they collect, and which barriers they
+   need. Any of them can be marked a step at a time with gcStep(), so
+   those that don't mark concurrently finish off the same way the
+   incremental collector does. */
+const Collector markSweepCollector = {
+  .name = "mark-sweep",
+  .allocate = allocateInChunks,
+  .allocateMany = allocateManyInChunks,
+  .reserveLarge = NULL,
+  .collectIfNeeded = collectIfNeededInChunks,
+  .collect = collectMarkSweep,
+  .completeMarking = finishIncrementalMark,
+  .writeBarrier = NULL,
+  .readBarrier = mark,
+  .stackBarrier = NULL,
+  .threshold = thresholdInChunks,
+  .footprint = footprintInChunks,
+  .growth = growthInChunks
+};
+
+const Collector lazySweepCollector = {
+  .name = "lazy-sweep",
+  .allocate = allocateInChunks,
+  .allocateMany = allocateManyInChunks,
+  .reserveLarge = NULL,
+  .collectIfNeeded = collectIfNeededInChunks,
+  .collect = collectMarkSweep,
+  .completeMarking = finishIncrementalMark,
+  .writeBarrier = NULL,
+  .readBarrier = mark,
+  .stackBarrier = NULL,
+  .threshold = thresholdInChunks,
+  .footprint = footprintInChunks,
+  .growth = growthInChunks
+};
+
+const Collector incrementalCollector = {
+  .name = "incremental",
+  .allocate = allocateInChunks,
+  .allocateMany = allocateManyInChunks,
+  .reserveLarge = NULL,
+  .collectIfNeeded = collectIfNeededIncremental,
+  .collect = collectMarkSweep,
+  .completeMarking = finishIncrementalMark,
+  .writeBarrier = NULL,
+  .readBarrier = mark,
+  .stackBarrier = NULL,
+  .threshold = thresholdInChunks,
+  .footprint = footprintInChunks,
+  .growth = growthInChunks
+};
+
+const Collector generationalCollector = {
+  .name = "generational",
+  .allocate = allocateInChunks,
+  .allocateMany = allocateManyInChunks,
+  .reserveLarge = NULL,
+  .collectIfNeeded = collectIfNeededGenerational,
+  .collect = collectMarkSweep,
+  .completeMarking = finishIncrementalMark,
+  .writeBarrier = generationalBarrier,
+  .readBarrier = mark,
+  .stackBarrier = NULL,
+  .threshold = thresholdGenerational,
+  .footprint = footprintInChunks,
+  .growth = growthInChunks
+};
+
+const Collector pretenuringCollector = {
+  .name = "pretenuring",
+  .allocate = allocateInChunks,
+  .allocateMany = allocateManyInChunks,
+  .reserveLarge = NULL,
+  .collectIfNeeded = collectIfNeededGenerational,
+  .collect = collectMarkSweep,
+  .completeMarking = finishIncrementalMark,
+  .writeBarrier = generationalBarrier,
+  .readBarrier = mark,
+  .stackBarrier = NULL,
+  .threshold = thresholdGenerational,
+  .footprint = footprintInChunks,
+  .growth = growthInChunks
+};
+
+const Collector parallelCollector = {
+  .name = "parallel",
+  .allocate = allocateInChunks,
+  .allocateMany = allocateManyInChunks,
+  .reserveLarge = NULL,
+  .collectIfNeeded = collectIfNeededInChunks,
+  .collect = collectMarkSweep,
+  .completeMarking = finishIncrementalMark,
+  .writeBarrier = NULL,
+  .readBarrier = mark,
+  .stackBarrier = NULL,
+  .threshold = thresholdInChunks,
+  .footprint = footprintInChunks,
+  .growth = growthInChunks
+};
+
+const Collector adaptiveCollector = {
+  .name = "adaptive",
+  .allocate = allocateInChunks,
+  .allocateMany = allocateManyInChunks,
+  .reserveLarge = NULL,
+  .collectIfNeeded = collectIfNeededInChunks,
+  .collect = collectMarkSweep,
+  .completeMarking = finishIncrementalMark,
+  .writeBarrier = NULL,
+  .readBarrier = mark,
+  .stackBarrier = NULL,
+  .threshold = thresholdInChunks,
+  .footprint = footprintInChunks,
+  .growth = growthInChunks
+};
+
+const Collector concurrentCollector = {
+  .name = "concurrent",
+  .allocate = allocateInChunks,
+  .allocateMany = allocateManyInChunks,
+  .reserveLarge = NULL,
+  .collectIfNeeded = collectIfNeededConcurrent,
+  .collect = collectMarkSweep,
+  .completeMarking = finishConcurrentMark,
+  .writeBarrier = NULL,
+  .readBarrier = satbShade,
+  .stackBarrier = satbShade,
+  .threshold = thresholdInChunks,
+  .footprint = footprintInChunks,
+  .growth = growthInChunks
+};
+
+const Collector copyingCollector = {
+  .name = "copying",
+  .allocate = allocateCopying,
+  .allocateMany = allocateManyCopying,
+  .reserveLarge = reserveLargeCopying,
+  .collectIfNeeded = NULL,
+  .collect = collectCopying,
+  .completeMarking = NULL,
+  .writeBarrier = NULL,
+  .readBarrier = NULL,
+  .stackBarrier = NULL,
+  .threshold = thresholdCopying,
+  .footprint = footprintCopying,
+  .growth = growthCopying
+};
+
+/* Function for allocating a new object into the stack. */
+Object* newObject(VM* vm, ObjectType type) {
+  return vm->ops->allocate(vm, type);
+}
+
+/* Create a new VM set up according to config. */
+VM* newVM(const VMConfig* config) {
+  assert(config->promotionAge >= 1 && config->promotionAge <= 255); // age is a byte
+  assert(config->nurserySize >= 1);
+  assert(config->sweepBatch >= 1);
+  assert(config->markRate >= 1);
+  assert(config->gcThreads >= 1);
+  assert(config->stackLimit >= 1);
+  assert(config->minHeapBytes >= 0);
+  assert(config->maxHeapBytes == 0 || config->maxHeapBytes >= config->minHeapBytes);
+  assert(config->heapGrowth > 1.0);
+  assert(!config->adaptive || config->gcTimeRatio > 0.0);
+  /* Incremental marking only knows how to do full collections. */
+  assert(!config->incremental || !config->generational);
+  pthread_once(&chunkPoolForkOnce, installChunkPoolFork);
+  assert(!config->incremental || config->collector == COLLECTOR_MARK_SWEEP);
+  /* Neither does concurrent marking, which is an alternative to it. */
+  assert(!config->concurrent || !config->generational);
+  assert(!config->concurrent || !config->incremental);
+  assert(!config->concurrent || config->collector == COLLECTOR_MARK_SWEEP);
+  /* The copying collector moves objects, so it doesn't do generations. */
+  assert(config->collector != COLLECTOR_COPYING || !config->generational);
+  /* Pretenuring is about skipping the nursery, so it needs one. */
+  assert(!config->pretenure || config->generational);
+
+  VM* vm = (VM *)malloc(sizeof(VM));
+  assert(vm != NULL); // Out of memory
+  vm->stackSize = 0;
+  vm->stackCommitted = 0;
+  vm->stackLimit = config->stackLimit;
+  vm->stack = (Value *)mmap(NULL, sizeof(Value) * (size_t)vm->stackLimit, PROT_NONE,
+    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  assert(vm->stack != MAP_FAILED); // Out of address space
+  vm->numObjects = 0;
+  vm->largeObjects = NULL;
+  vm->largeBytes = 0;
+  vm->weakRefs = NULL;
+  vm->weakCount = 0;
+  vm->weakCapacity = 0;
+  vm->cleared = NULL;
+  vm->clearedNext = 0;
+  vm->clearedCount = 0;
+  vm->clearedCapacity = 0;
+  vm->sampleRate = config->sampleRate;
+  vm->sampleCountdown = config->sampleRate;
+  vm->sites = NULL;
+  vm->numSites = 0;
+  vm->sitesCapacity = 0;
+  vm->currentSite = -1;
+  vm->samples = NULL;
+  vm->numSamples = 0;
+  vm->samplesCapacity = 0;
+  vm->maxBytes = config->minHeapBytes;
+  vm->minHeapBytes = config->minHeapBytes;
+  vm->maxHeapBytes = config->maxHeapBytes;
+  vm->heapLimitBytes = config->heapLimitBytes;
+  vm->releaseDelay = config->releaseDelay;
+  vm->heapGrowth = config->heapGrowth;
+  vm->adaptive = config->adaptive;
+  vm->gcTimeRatio = config->gcTimeRatio;
+  vm->adaptStart = nanoTime();
+  vm->adaptGCNanos = 0;
+  vm->collector = config->collector;
+  if(vm->collector == COLLECTOR_COPYING) {
+    vm->ops = &copyingCollector;
+  } else if(config->concurrent) {
+    vm->ops = &concurrentCollector;
+  } else if(config->incremental) {
+    vm->ops = &incrementalCollector;
+  } else if(config->pretenure) {
+    vm->ops = &pretenuringCollector;
+  } else if(config->generational) {
+    vm->ops = &generationalCollector;
+  } else if(config->gcThreads > 1) {
+    vm->ops = &parallelCollector;
+  } else if(config->adaptive) {
+    vm->ops = &adaptiveCollector;
+  } else if(config->lazySweep) {
+    vm->ops = &lazySweepCollector;
+  } else {
+    vm->ops = &markSweepCollector;
+  }
+  vm->barrier = vm->ops->writeBarrier;
+  vm->fromSpace = NULL;
+  vm->spaceCapacity = 0;
+  vm->spaceUsed = 0;
+  vm->numYoung = 0;
+  vm->generational = config->generational;
+  vm->nurserySize = config->nurserySize;
+  vm->promotionAge = config->promotionAge;
+  vm->pretenure = config->pretenure;
+  vm->collectingYoung = 0;
+  vm->remembered = NULL;
+  vm->rememberedCount = 0;
+  vm->rememberedCapacity = 0;
+  vm->lazySweep = config->lazySweep;
+  vm->sweepBatch = config->sweepBatch;
+  vm->sweeping = 0;
+  vm->sweepingFull = 0;
+  vm->sweepCursor = 0;
+  initSweepState(&vm->sweepState);
+  vm->markRate = config->markRate;
+  vm->marking = 0;
+  vm->concurrent = config->concurrent;
+  vm->markerShutdown = 0;
+  vm->markerScanStack = 0;
+  atomic_init(&vm->markerIdle, 1);
+  vm->satbQueue = NULL;
+  vm->satbQueueCount = 0;
+  vm->satbQueueCapacity = 0;
+  vm->satbBuffer = NULL;
+  vm->satbBufferCount = 0;
+  vm->markerGray = NULL;
+  vm->markerGrayCount = 0;
+  vm->markerGrayCapacity = 0;
+  vm->markerMarked = 0;
+  vm->markerNanos = 0;
+  vm->gcThreads = config->gcThreads;
+  vm->workers = NULL;
+  vm->poolJob = NULL;
+  vm->poolGeneration = 0;
+  vm->poolBusy = 0;
+  vm->poolShutdown = 0;
+  atomic_init(&vm->idleWorkers, 0);
+  vm->chunks = NULL;
+  vm->numChunks = 0;
+  vm->chunksCapacity = 0;
+  vm->freeList = NULL;
+  vm->freeListTail = NULL;
+  vm->bump = NULL;
+  vm->bumpEnd = NULL;
+  vm->interned = NULL;
+  vm->internedCount = 0;
+  vm->internedCapacity = 0;
+  vm->internChunks = NULL;
+  vm->numInternChunks = 0;
+  vm->internBump = NULL;
+  vm->internBumpEnd = NULL;
+  vm->grayStack = NULL;
+  vm->grayCount = 0;
+  vm->grayCapacity = 0;
+  vm->numMarked = 0;
+  vm->markNanos = 0;
+  memset(&vm->stats, 0, sizeof(GCStats));
+  memset(&vm->cycle, 0, sizeof(GCCycle));
+  vm->pauseDepth = 0;
+  vm->pauseStart = 0;
+  vm->snapshots = NULL;
+  vm->numSnapshots = 0;
+
+  if(vm->collector == COLLECTOR_COPYING) {
+    vm->spaceCapacity = config->initialCapacity > SEMISPACE_MIN ? config->initialCapacity : SEMISPACE_MIN;
+    vm->fromSpace = (Object *)malloc(sizeof(Object) * vm->spaceCapacity);
+    assert(vm->fromSpace != NULL); // Out of memory
+  } else {
+    while(vm->numChunks * OBJECTS_PER_CHUNK < config->initialCapacity) {
+      growPool(vm);
+    }
+  }
+
+  if(vm->gcThreads > 1) {
+    pthread_mutex_init(&vm->poolLock, NULL);
+    pthread_cond_init(&vm->poolWake, NULL);
+    pthread_cond_init(&vm->poolDone, NULL);
+    vm->workers = (GCWorker *)malloc(sizeof(GCWorker) * vm->gcThreads);
+    assert(vm->workers != NULL); // Out of memory
+    for(int i = 0; i < vm->gcThreads; i++) {
+      GCWorker* worker = &vm->workers[i];
+      worker->vm = vm;
+      worker->id = i;
+      worker->numMarked = 0;
+      initSweepState(&worker->sweep);
+      worker->seed = (unsigned int)i * 2654435761u + 1;
+      initDeque(&worker->deque);
+      if(i > 0) {
+        int result = pthread_create(&worker->thread, NULL, poolThread, worker);
+        assert(result == 0); // Couldn't start a GC thread
+        (void)result;
+      }
+    }
+  }
+
+  if(vm->concurrent) {
+    vm->satbBuffer = (Object **)malloc(sizeof(Object*) * SATB_BUFFER_SIZE);
+    assert(vm->satbBuffer != NULL); // Out of memory
+    pthread_mutex_init(&vm->markerLock, NULL);
+    pthread_cond_init(&vm->markerWake, NULL);
+    pthread_cond_init(&vm->markerDone, NULL);
+    int result = pthread_create(&vm->marker, NULL, markerThread, vm);
+    assert(result == 0); // Couldn't start the marker thread
+    (void)result;
+  }
+  TRACE(1, "Created a VM with the %s collector.\n", vm->ops->name);
+  return vm;
+}
+
+/* Ints go straight on the stack, no allocation required. */
+VMStatus pushInt(VM* vm, int value) {
+  return push(vm, intValue(value));
+}
+
+Object* pushPair(VM* vm) {
+  Object* object = newObject(vm, OBJ_PAIR);
+  setTail(vm, object, pop(vm));
+  setHead(vm, object, pop(vm));
+
+  push(vm, objectValue(object));
+  return object;
+}
+
+/* Allocate n objects in one go, linked together through their tails with
+   the last tail left NIL, and return the first, or NULL if n is 0.
+   However many there are we only check whether to collect once. They're
+   side by side in memory, in order, whenever that's possible without
+   growing the heap any sooner than it would anyway (see takeRun()), and
+   always under the copying collector. Otherwise they're wherever
+   takeSlot() finds room. Like newObject(), nothing points at them yet, so
+   they need to be somewhere a collection will find them before anything
+   else is allocated. */
+Object* newObjects(VM* vm, ObjectType type, int n) {
+  assert(n >= 0);
+  if(n == 0) return NULL;
+  return vm->ops->allocateMany(vm, type, n);
+}
+
+/* Push a list of the n ints in values: pairs with an int in the head and
+   the rest of the list in the tail, and NIL at the end. An empty list is
+   just NIL. If there's no room on the stack for it, nothing's allocated
+   at all, since nothing would be holding on to it. */
+VMStatus pushList(VM* vm, const int* values, int n) {
+  if(!stackHasRoom(vm)) return VM_STACK_OVERFLOW;
+  Object* first = newObjects(vm, OBJ_PAIR, n);
+  /* They're brand new and only point at each other, so there's nothing
+     for the write barrier to do. */
+  Object* object = first;
+  for(int i = 0; i < n; i++) {
+    object->head = intValue(values[i]);
+    object = isObject(object->tail) ? asObject(object->tail) : NULL;
+  }
+
+  return push(vm, first ? objectValue(first) : NIL_VALUE);
+}
+
+/* Allocate an object with a payload of payloadBytes in the large object
+   space, all zeroes, which makes an array's elements NIL. */
+Object* newLarge(VM* vm, ObjectType type, size_t length, size_t payloadBytes) {
+  if(vm->ops->reserveLarge) vm->ops->reserveLarge(vm);
+  size_t size = sizeof(LargeObject) + payloadBytes;
+  reserveHeap(vm, 1, (long)size);
+  Object* object = newObject(vm, type);
+
+  LargeObject* large;
+  if(size >= LARGE_MMAP_MIN) {
+    large = (LargeObject *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(large != MAP_FAILED); // Out of memory
+  } else {
+    large = (LargeObject *)calloc(1, size);
+    assert(large != NULL); // Out of memory
+  }
+  large->owner = object;
+  large->size = size;
+  large->next = vm->largeObjects;
+  vm->largeObjects = large;
+  vm->largeBytes += (long)size;
+
+  object->length = length;
+  object->large = large;
+  TRACE(2, "Created a payload of %zu bytes, large object space is now %ld bytes\n", payloadBytes, vm->largeBytes);
+  return object;
+}
+
+/* An array of length elements, all NIL to start with. */
+Object* newArray(VM* vm, size_t length) {
+  assert(length <= (SIZE_MAX - sizeof(LargeObject)) / sizeof(Value)); // Too big
+  return newLarge(vm, OBJ_ARRAY, length, length * sizeof(Value));
+}
+
+/* A buffer of length bytes, all zero to start with. */
+Object* newBytes(VM* vm, size_t length) {
+  assert(length <= SIZE_MAX - sizeof(LargeObject)); // Too big
+  return newLarge(vm, OBJ_BYTES, length, length);
+}
+
+Value* arrayElements(Object* array) {
+  assert(array->type == OBJ_ARRAY);
+  return array->large->values;
+}
+
+unsigned char* bytesData(Object* bytes) {
+  assert(bytes->type == OBJ_BYTES);
+  return (unsigned char *)bytes->large->values;
+}
+
+/* Store into an array, the way setHead() and setTail() do into a pair. */
+void setElement(VM* vm, Object* array, size_t index, Value value) {
+  assert(array->type == OBJ_ARRAY && index < array->length);
+  Value* element = &array->large->values[index];
+  writeBarrier(vm, array, *element, value);
+  __atomic_store_n(element, value, __ATOMIC_RELEASE);
+}
+
+/* Pop the top length values off the stack into a new array, the deepest
+   first, and push the array. Returns NULL, without allocating, if the
+   array is empty and there's no room on the stack for it. */
+Object* pushArray(VM* vm, int length) {
+  assert(length >= 0 && length <= vm->stackSize); // Stack underflow
+  /* Otherwise it takes the place of what it pops. */
+  if(length == 0 && !stackHasRoom(vm)) return NULL;
+  /* The elements stay on the stack while we allocate, so a collection
+     there sees them, and moves them if it's copying. */
+  Object* array = newArray(vm, (size_t)length);
+  Value* elements = array->large->values;
+  for(int i = length - 1; i >= 0; i--) {
+    /* It's brand new, so there's nothing for the write barrier to do. */
+    elements[i] = pop(vm);
+  }
+  /* Unless it was pretenured, and it's now an old array pointing at young
+     objects. */
+  if(!isYoung(array) && pointsAtYoung(array)) remember(vm, array);
+
+  push(vm, objectValue(array));
+  return array;
+}
+
+/* Push a new byte buffer holding a copy of length bytes from data. Returns
+   NULL, without allocating, if there's no room on the stack for it. */
+Object* pushBytes(VM* vm, const void* data, size_t length) {
+  if(!stackHasRoom(vm)) return NULL;
+  Object* bytes = newBytes(vm, length);
+  if(length > 0) memcpy(bytesData(bytes), data, length);
+  push(vm, objectValue(bytes));
+  return bytes;
+}
+
+/* Pop data, then a target, and push a weak reference to the target. It
+   doesn't keep the target alive: once nothing else does either, a
+   collection clears the reference and, unless data is NIL, queues data
+   up for pushCleared(). Data stays alive as long as the reference or the
+   queue has it, so it can say which cache entry to throw away, say. */
+Object* pushWeak(VM* vm) {
+  Object* weak = newObject(vm, OBJ_WEAK);
+  /* It's brand new, so there's nothing for the write barrier to do. */
+  __atomic_store_n(&weak->tail, pop(vm), __ATOMIC_RELEASE);
+  Value target = pop(vm);
+  __atomic_store_n(&weak->head, target, __ATOMIC_RELEASE);
+  /* Unless it was pretenured, and its data is young. */
+  if(!isYoung(weak) && pointsAtYoung(weak)) remember(vm, weak);
+
+  /* Ints, snapshots and interned pairs never go away, so there's no point
+     keeping track. */
+  if(isObject(target) && !isImmortal(vm, asObject(target))) {
+    if(vm->weakCount == vm->weakCapacity) {
+      vm->weakCapacity = vm->weakCapacity ? vm->weakCapacity * 2 : REMEMBERED_INITIAL;
+      vm->weakRefs = (Object **)realloc(vm->weakRefs, sizeof(Object*) * vm->weakCapacity);
+      assert(vm->weakRefs != NULL); // Out of memory
+    }
+    vm->weakRefs[vm->weakCount++] = weak;
+  }
+
+  push(vm, objectValue(weak));
+  return weak;
+}
+
+/* What a weak reference points at, or NIL if that's been collected. While
+   an incremental or concurrent collection is marking we have to shade it,
+   or it could end up somewhere the collection has already been through
+   and get freed anyway. */
+Value weakTarget(VM* vm, Object* weak) {
+  assert(weak->type == OBJ_WEAK);
+  Value target = weak->head;
+  if(vm->marking) vm->ops->readBarrier(vm, target);
+  return target;
+}
+
+/* Push the data of the oldest weak reference to have been cleared and set
+   *pushed to 1, or set it to 0 if there aren't any. The collector only
+   queues them up, so whatever the program does about them happens here,
+   on its own time, rather than in a GC pause. If the stack's full the
+   data stays queued for next time. Marking only looks at the queue once
+   it's nearly done, so while it's under way whatever we take off has to
+   be shaded, just like weakTarget() does. */
+VMStatus pushCleared(VM* vm, int* pushed) {
+  *pushed = 0;
+  if(vm->clearedNext == vm->clearedCount) return VM_OK;
+  if(!stackHasRoom(vm)) return VM_STACK_OVERFLOW;
+  Value data = vm->cleared[vm->clearedNext++];
+  if(vm->marking) vm->ops->readBarrier(vm, data);
+  if(vm->clearedNext == vm->clearedCount) {
+    vm->clearedNext = 0;
+    vm->clearedCount = 0;
+  }
+  *pushed = 1;
+  return push(vm, data);
+}
+
+/* Carve an interned pair off the intern chunks, which are ours alone, and
+   never swept. Its mark bit is set for good, so marking goes straight
+   past. */
+Object* newInterned(VM* vm, Value head, Value tail) {
+  if(vm->internBump == vm->internBumpEnd) {
+    reserveHeap(vm, 0, CHUNK_SIZE);
+    Chunk* chunk = takeChunk();
+    memset(chunk->marks, 0, sizeof(chunk->marks));
+    memset(chunk->live, 0, sizeof(chunk->live));
+    memset(chunk->young, 0, sizeof(chunk->young));
+    chunk->needsSweep = 0;
+    chunk->emptyFor = 0;
+    vm->internChunks = (Chunk **)realloc(vm->internChunks, sizeof(Chunk*) * (vm->numInternChunks + 1));
+    assert(vm->internChunks != NULL); // Out of memory
+    vm->internChunks[vm->numInternChunks++] = chunk;
+    vm->internBump = chunk->objects;
+    vm->internBumpEnd = chunk->objects + OBJECTS_PER_CHUNK;
+  }
+  Object* object = vm->internBump++;
+  Chunk* chunk = chunkFor(object);
+  int index = (int)(object - chunk->objects);
+  chunk->live[index / 64] |= (uint64_t)1 << (index % 64);
+  /* The concurrent marker might be looking at this word. */
+  __atomic_fetch_or(&chunk->marks[index / 64], (uint64_t)1 << (index % 64), __ATOMIC_RELAXED);
+  object->type = OBJ_PAIR;
+  object->age = 0;
+  object->flags = OBJECT_OLD | OBJECT_INTERNED;
+  object->head = head;
+  object->tail = tail;
+  return object;
+}
+
+/* Pop a tail, then a head, and push a pair of them, like pushPair(), but
+   if there's already an interned pair holding the same two values, push
+   that instead. Interned pairs are immortal and can't be changed. They
+   can only hold ints, NIL and other immortal objects, so if the head or
+   the tail is an ordinary object, this is just pushPair(). Handy for data
+   that repeats itself a lot: the same tree built a million times over is
+   only allocated once. */
+Object* pushInterned(VM* vm) {
+  assert(vm->stackSize >= 2); // Stack underflow
+  Value head = vm->stack[vm->stackSize - 2];
+  Value tail = vm->stack[vm->stackSize - 1];
+  if((isObject(head) && !isImmortal(vm, asObject(head))) ||
+     (isObject(tail) && !isImmortal(vm, asObject(tail)))) {
+    return pushPair(vm);
+  }
+  pop(vm);
+  pop(vm);
+
+  if(vm->internedCapacity == 0) {
+    vm->internedCapacity = 1024;
+    vm->interned = (Object **)calloc(vm->internedCapacity, sizeof(Object*));
+    assert(vm->interned != NULL); // Out of memory
+  }
+  size_t slot = internSlot(vm->interned, vm->internedCapacity, head, tail);
+  Object* pair = vm->interned[slot];
+  if(pair == NULL) {
+    pair = newInterned(vm, head, tail);
+    vm->interned[slot] = pair;
+    vm->internedCount++;
+    TRACE(2, "Interned a new pair, %zu in the table\n", vm->internedCount);
+
+    /* Keep the table at most half full. */
+    if(vm->internedCount * 2 > vm->internedCapacity) {
+      size_t capacity = vm->internedCapacity * 2;
+      Object** table = (Object **)calloc(capacity, sizeof(Object*));
+      assert(table != NULL); // Out of memory
+      for(size_t i = 0; i < vm->internedCapacity; i++) {
+        Object* object = vm->interned[i];
+        if(object) table[internSlot(table, capacity, object->head, object->tail)] = object;
+      }
+      free(vm->interned);
+      vm->interned = table;
+      vm->internedCapacity = capacity;
+    }
+  }
+
+  push(vm, objectValue(pair));
+  return pair;
+}
+
+/* The instructions vmRun() understands. PUSH_INT, JUMP and JUMP_IF are
+   followed by an operand, the rest are on their own. */
+typedef enum {
+  OP_PUSH_INT, /* Push the operand. */
+  OP_PAIR,     /* Pop a tail and then a head and push a new pair of them. */
+  OP_POP,      /* Throw away the top of the stack. */
+  OP_DUP,      /* Push a copy of the top of the stack. */
+  OP_OVER,     /* Push a copy of the one under it. */
+  OP_SWAP,     /* Swap the top two. */
+  OP_HEAD,     /* Replace the pair on top with its head. */
+  OP_TAIL,     /* Or its tail. */
+  OP_ADD,      /* Pop two ints and push their sum. */
+  OP_JUMP,     /* Carry on from the operand, an index into the code. */
+  OP_JUMP_IF,  /* Pop an int and jump to the operand if it isn't zero. */
+  OP_HALT      /* Stop. */
+} OpCode;
+
+/* Run a program on the VM's stack until it gets to OP_HALT. The code is
+   trusted to be well formed, with jumps that land on instructions and an
+   OP_HALT at the end, but what it does with the stack is checked, and a
+   program that goes wrong stops with the stack as it was before the bad
+   instruction.
+
+   This is direct threaded: each instruction jumps straight to the next
+   one's code through a table of label addresses, a GCC extension, rather
+   than going back round a switch. The top of the stack lives in sp rather
+   than vm->stackSize, and only goes back there when something else might
+   look at the stack, which is when we allocate. */
+VMStatus vmRun(VM* vm, const int* code) {
+  /* In the same order as OpCode. */
+  static void* dispatch[] = {
+    &&opPushInt, &&opPair, &&opPop, &&opDup, &&opOver, &&opSwap,
+    &&opHead, &&opTail, &&opAdd, &&opJump, &&opJumpIf, &&opHalt
+  };
+  const int* ip = code;
+  Value* sp = vm->stack + vm->stackSize;
+  Value* committed = vm->stack + vm->stackCommitted;
+  VMStatus status = VM_OK;
+
+/* Go on to the next instruction. */
+#define NEXT() goto *dispatch[*ip++]
+/* Give vm->stackSize the truth. Released for the concurrent marker, like
+   push(). */
+#define SPILL() __atomic_store_n(&vm->stackSize, (int)(sp - vm->stack), __ATOMIC_RELEASE)
+/* Stop with status. */
+#define FAIL(error) do { status = (error); goto done; } while(0)
+#define NEED(count) if(sp - vm->stack < (count)) FAIL(VM_STACK_UNDERFLOW)
+/* Make sure there's room to push one more. */
+#define ROOM() \
+  if(sp == committed) { \
+    SPILL(); \
+    if(!stackHasRoom(vm)) FAIL(VM_STACK_OVERFLOW); \
+    committed = vm->stack + vm->stackCommitted; \
+  }
+/* Stores into the stack are atomic for the concurrent marker, like
+   push(). */
+#define PUT(slot, value) __atomic_store_n((slot), (value), __ATOMIC_RELAXED)
+
+  NEXT();
+
+opPushInt:
+  ROOM();
+  PUT(sp++, intValue(*ip++));
+  NEXT();
+
+opPair: {
+  NEED(2);
+  /* The head and tail stay on the stack while we allocate, so a collection
+     there sees them, and moves them if it's copying. */
+  SPILL();
+  Object* pair = newObject(vm, OBJ_PAIR);
+  Value tail = sp[-1];
+  Value head = sp[-2];
+  stackBarrier(vm, tail);
+  stackBarrier(vm, head);
+  setHead(vm, pair, head);
+  setTail(vm, pair, tail);
+  sp--;
+  PUT(sp - 1, objectValue(pair));
+  NEXT();
+}
+
+opPop:
+  NEED(1);
+  sp--;
+  stackBarrier(vm, *sp);
+  NEXT();
+
+opDup:
+  NEED(1);
+  ROOM();
+  PUT(sp, sp[-1]);
+  sp++;
+  NEXT();
+
+opOver:
+  NEED(2);
+  ROOM();
+  PUT(sp, sp[-2]);
+  sp++;
+  NEXT();
+
+/* Nothing leaves the stack, so the concurrent marker either sees both of
+   these now or in its final look at the stack, or they get popped. */
+opSwap: {
+  NEED(2);
+  Value top = sp[-1];
+  PUT(sp - 1, sp[-2]);
+  PUT(sp - 2, top);
+  NEXT();
+}
+
+opHead:
+  NEED(1);
+  if(!isPair(sp[-1])) FAIL(VM_TYPE_ERROR);
+  stackBarrier(vm, sp[-1]);
+  PUT(sp - 1, asObject(sp[-1])->head);
+  NEXT();
+
+opTail:
+  NEED(1);
+  if(!isPair(sp[-1])) FAIL(VM_TYPE_ERROR);
+  stackBarrier(vm, sp[-1]);
+  PUT(sp - 1, asObject(sp[-1])->tail);
+  NEXT();
+
+opAdd:
+  NEED(2);
+  if(!isInt(sp[-1]) || !isInt(sp[-2])) FAIL(VM_TYPE_ERROR);
+  /* Wrapping around rather than overflowing. */
+  PUT(sp - 2, intValue((int)((unsigned int)asInt(sp[-2]) + (unsigned int)asInt(sp[-1]))));
+  sp--;
+  NEXT();
+
+opJump:
+  ip = code + *ip;
+  NEXT();
+
+opJumpIf:
+  NEED(1);
+  if(!isInt(sp[-1])) FAIL(VM_TYPE_ERROR);
+  sp--;
+  if(asInt(*sp) != 0) {
+    ip = code + *ip;
+  } else {
+    ip++;
+  }
+  NEXT();
+
+opHalt:
+done:
+  SPILL();
+  return status;
+
+#undef NEXT
+#undef SPILL
+#undef FAIL
+#undef NEED
+#undef ROOM
+#undef PUT
+}
+
+/* Where vmSaveSnapshot() is putting each object it's found, a hash table
+   from the object to its index in the file. */
+typedef struct {
+  Object** objects;
+  uint64_t* indexes;
+  size_t capacity;
+} SnapshotMap;
+
+size_t snapshotSlot(SnapshotMap* map, Object* object) {
+  size_t slot = (size_t)(((uintptr_t)object >> 3) * 0x9E3779B97F4A7C15ull) & (map->capacity - 1);
+  while(map->objects[slot] != NULL && map->objects[slot] != object) {
+    slot = (slot + 1) & (map->capacity - 1);
+  }
+  return slot;
+}
+
+/* The objects we're saving, in the order they'll be written. */
+typedef struct {
+  Object** objects;
+  size_t count;
+  size_t capacity;
+} SnapshotList;
+
+/* Make sure an object is going in the snapshot. */
+void snapshotAdd(SnapshotMap* map, SnapshotList* list, Value value) {
+  if(!isObject(value)) return;
+  Object* object = asObject(value);
+
+  /* Keep the table at most half full. */
+  if((list->count + 1) * 2 > map->capacity) {
+    SnapshotMap bigger;
+    bigger.capacity = map->capacity ? map->capacity * 2 : 1024;
+    bigger.objects = (Object **)calloc(bigger.capacity, sizeof(Object*));
+    bigger.indexes = (uint64_t *)malloc(sizeof(uint64_t) * bigger.capacity);
+    assert(bigger.objects != NULL && bigger.indexes != NULL); // Out of memory
+    for(size_t i = 0; i < map->capacity; i++) {
+      if(map->objects[i] == NULL) continue;
+      size_t slot = snapshotSlot(&bigger, map->objects[i]);
+      bigger.objects[slot] = map->objects[i];
+      bigger.indexes[slot] = map->indexes[i];
+    }
+    free(map->objects);
+    free(map->indexes);
+    *map = bigger;
+  }
+
+  size_t slot = snapshotSlot(map, object);
+  if(map->objects[slot] != NULL) return;
+  map->objects[slot] = object;
+  map->indexes[slot] = list->count;
+
+  if(list->count == list->capacity) {
+    list->capacity = list->capacity ? list->capacity * 2 : 1024;
+    list->objects = (Object **)realloc(list->objects, sizeof(Object*) * list->capacity);
+    assert(list->objects != NULL); // Out of memory
+  }
+  list->objects[list->count++] = object;
+}
+
+/* What a Value looks like in the file: ints as they are, objects as their
+   offset from the start of it. */
+Value snapshotEncode(SnapshotMap* map, uint64_t objectsOffset, Value value) {
+  if(!isObject(value)) return value;
+  size_t slot = snapshotSlot(map, asObject(value));
+  return (Value)(objectsOffset + map->indexes[slot] * sizeof(Object));
+}
+
+/* Write everything reachable from the stack to a snapshot file at path,
+   stack and all, for vmLoadSnapshot() to pick up again later. */
+VMStatus vmSaveSnapshot(VM* vm, const char* path) {
+  SnapshotMap map = { NULL, NULL, 0 };
+  SnapshotList list = { NULL, 0, 0 };
+
+  /* Find everything reachable, breadth first. The list is its own queue.
+     Snapshots only know about pairs. */
+  for(int i = 0; i < vm->stackSize; i++) {
+    snapshotAdd(&map, &list, vm->stack[i]);
+  }
+  for(size_t i = 0; i < list.count; i++) {
+    if(list.objects[i]->type != OBJ_PAIR) {
+      free(map.objects);
+      free(map.indexes);
+      free(list.objects);
+      return VM_TYPE_ERROR;
+    }
+    snapshotAdd(&map, &list, list.objects[i]->head);
+    snapshotAdd(&map, &list, list.objects[i]->tail);
+  }
+
+  SnapshotHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, "BABYSNAP", 8);
+  header.version = 1;
+  header.objectSize = sizeof(Object);
+  header.numRoots = vm->stackSize;
+  header.numObjects = list.count;
+  size_t rootsEnd = sizeof(header) + sizeof(Value) * (size_t)vm->stackSize;
+  header.objectsOffset = (rootsEnd + SNAPSHOT_ALIGN - 1) / SNAPSHOT_ALIGN * SNAPSHOT_ALIGN;
+
+  VMStatus status = VM_OK;
+  FILE* file = fopen(path, "wb");
+  if(file == NULL) {
+    status = VM_IO_ERROR;
+  } else {
+    int ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    for(int i = 0; ok && i < vm->stackSize; i++) {
+      Value root = snapshotEncode(&map, header.objectsOffset, vm->stack[i]);
+      ok = fwrite(&root, sizeof(root), 1, file) == 1;
+    }
+    for(size_t i = rootsEnd; ok && i < header.objectsOffset; i++) {
+      ok = fputc(0, file) != EOF;
+    }
+    /* Everything in a snapshot is as old as it gets. */
+    for(size_t i = 0; ok && i < list.count; i++) {
+      Object copy;
+      memset(&copy, 0, sizeof(copy));
+      copy.type = list.objects[i]->type;
+      copy.flags = OBJECT_OLD;
+      copy.head = snapshotEncode(&map, header.objectsOffset, list.objects[i]->head);
+      copy.tail = snapshotEncode(&map, header.objectsOffset, list.objects[i]->tail);
+      ok = fwrite(&copy, sizeof(copy), 1, file) == 1;
+    }
+    if(fclose(file) != 0) ok = 0;
+    if(!ok) status = VM_IO_ERROR;
+  }
+
+  TRACE(1, "Saved a snapshot of %zu objects to %s.\n", list.count, path);
+  free(map.objects);
+  free(map.indexes);
+  free(list.objects);
+  return status;
+}
+
+/* Map in a snapshot vmSaveSnapshot() wrote and push what was on its stack
+   onto ours. The snapshot's objects don't count towards the heap: they're
+   never swept, never moved and can't be changed, and none of it is read
+   until it's used. */
+VMStatus vmLoadSnapshot(VM* vm, const char* path) {
+  /* The concurrent marker looks through vm->snapshots, so it can't grow
+     under it. */
+  if(vm->marking && vm->concurrent) finishConcurrentMark(vm);
+
+  int fd = open(path, O_RDONLY);
+  if(fd < 0) return VM_IO_ERROR;
+
+  struct stat info;
+  SnapshotHeader header;
+  if(fstat(fd, &info) != 0 || pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header)) {
+    close(fd);
+    return VM_BAD_SNAPSHOT;
+  }
+  size_t size = (size_t)info.st_size;
+  if(memcmp(header.magic, "BABYSNAP", 8) != 0 || header.version != 1 ||
+     header.objectSize != sizeof(Object) || header.objectsOffset % SNAPSHOT_ALIGN != 0 ||
+     sizeof(header) + sizeof(Value) * header.numRoots > header.objectsOffset ||
+     header.objectsOffset + header.numObjects * sizeof(Object) > size) {
+    close(fd);
+    return VM_BAD_SNAPSHOT;
+  }
+  if(header.numRoots > (uint64_t)(vm->stackLimit - vm->stackSize)) {
+    close(fd);
+    return VM_STACK_OVERFLOW;
+  }
+
+  Value* roots = (Value *)malloc(sizeof(Value) * (header.numRoots + 1));
+  assert(roots != NULL); // Out of memory
+  size_t rootsSize = sizeof(Value) * header.numRoots;
+  if(pread(fd, roots, rootsSize, sizeof(header)) != (ssize_t)rootsSize) {
+    free(roots);
+    close(fd);
+    return VM_BAD_SNAPSHOT;
+  }
+
+  /* Nothing's readable until snapshotFault() has relocated it. */
+  char* base = (char *)mmap(NULL, size, PROT_NONE, MAP_PRIVATE, fd, 0);
+  if(base == MAP_FAILED) {
+    close(fd);
+    free(roots);
+    return VM_IO_ERROR;
+  }
+  pthread_once(&snapshotFaultOnce, installSnapshotFault);
+  assert(snapshotPageSize <= SNAPSHOT_ALIGN); // Pages too big for the snapshot format
+
+  Snapshot* snapshot = (Snapshot *)malloc(sizeof(Snapshot));
+  assert(snapshot != NULL); // Out of memory
+  snapshot->base = base;
+  snapshot->length = size;
+  snapshot->fd = fd;
+  snapshot->objects = (Object *)(base + header.objectsOffset);
+  snapshot->objectsEnd = snapshot->objects + header.numObjects;
+  size_t pages = (header.numObjects * sizeof(Object) + snapshotPageSize - 1) / snapshotPageSize;
+  snapshot->relocated = (_Atomic(unsigned char) *)calloc(pages + 1, sizeof(_Atomic(unsigned char)));
+  assert(snapshot->relocated != NULL); // Out of memory
+
+  int registered = 0;
+  for(int i = 0; i < SNAPSHOTS_MAX && !registered; i++) {
+    Snapshot* expected = NULL;
+    registered = atomic_compare_exchange_strong(&mappedSnapshots[i], &expected, snapshot);
+  }
+  assert(registered); // Too many snapshots loaded
+  (void)registered;
+  vm->snapshots = (Snapshot **)realloc(vm->snapshots, sizeof(Snapshot*) * (vm->numSnapshots + 1));
+  assert(vm->snapshots != NULL); // Out of memory
+  vm->snapshots[vm->numSnapshots++] = snapshot;
+
+  for(uint64_t i = 0; i < header.numRoots; i++) {
+    Value root = roots[i];
+    push(vm, isObject(root) ? (Value)(base + root) : root);
+  }
+  free(roots);
+  TRACE(1, "Loaded a snapshot of %lu objects from %s.\n", (unsigned long)header.numObjects, path);
+  return VM_OK;
+}
+
+/* Make sure an object that isn't frozen already is going to be. Objects
+   that are immortal to begin with stay where they are. */
+void freezeAdd(VM* vm, SnapshotMap* map, SnapshotList* list, Value value) {
+  if(isObject(value) && !isImmortal(vm, asObject(value))) snapshotAdd(map, list, value);
+}
+
+/* Where a value points once everything's been frozen. */
+Value freezeValue(SnapshotMap* map, Object* frozen, Value value) {
+  if(!isObject(value)) return value;
+  size_t slot = snapshotSlot(map, asObject(value));
+  if(map->objects[slot] == NULL) return value;
+  return objectValue(&frozen[map->indexes[slot]]);
+}
+
+/* Move everything reachable from the stack into a region of its own
+   that's sealed against writes and never collected, like a snapshot that
+   was never saved. This is for a server that builds up a big graph of
+   pairs it's never going to change and then forks workers: the workers
+   share the frozen pages with the parent and each other for good, since
+   marking stops at them and sweeping never sees them, and they don't
+   count towards the heap. What's left behind is garbage, so this finishes
+   with a full collection. Like snapshots, this only knows about pairs, and
+   if it finds anything else it returns VM_TYPE_ERROR without changing
+   anything. */
+VMStatus vmFreeze(VM* vm) {
+  /* The concurrent marker looks through vm->snapshots, so it can't grow
+     under it. And a collection that's marking has been told about objects
+     we're about to move. */
+  if(vm->marking) vm->ops->completeMarking(vm);
+
+  SnapshotMap map = { NULL, NULL, 0 };
+  SnapshotList list = { NULL, 0, 0 };
+  /* The queue of cleared weak references' data is a root too. */
+  for(int i = 0; i < vm->stackSize; i++) {
+    freezeAdd(vm, &map, &list, vm->stack[i]);
+  }
+  for(int i = vm->clearedNext; i < vm->clearedCount; i++) {
+    freezeAdd(vm, &map, &list, vm->cleared[i]);
+  }
+  for(size_t i = 0; i < list.count; i++) {
+    if(list.objects[i]->type != OBJ_PAIR) {
+      free(map.objects);
+      free(map.indexes);
+      free(list.objects);
+      return VM_TYPE_ERROR;
+    }
+    freezeAdd(vm, &map, &list, list.objects[i]->head);
+    freezeAdd(vm, &map, &list, list.objects[i]->tail);
+  }
+  if(list.count == 0) return VM_OK;
+
+  /* Fresh pages come zeroed, which is most of an old pair's header. */
+  size_t size = list.count * sizeof(Object);
+  Object* frozen = (Object *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  assert(frozen != MAP_FAILED); // Out of memory
+  for(size_t i = 0; i < list.count; i++) {
+    frozen[i].type = OBJ_PAIR;
+    frozen[i].flags = OBJECT_OLD;
+    frozen[i].head = freezeValue(&map, frozen, list.objects[i]->head);
+    frozen[i].tail = freezeValue(&map, frozen, list.objects[i]->tail);
+  }
+  mprotect(frozen, size, PROT_READ);
+
+  Snapshot* region = (Snapshot *)malloc(sizeof(Snapshot));
+  assert(region != NULL); // Out of memory
+  region->base = (char *)frozen;
+  region->length = size;
+  region->objects = frozen;
+  region->objectsEnd = frozen + list.count;
+  region->fd = -1;
+  region->relocated = NULL;
+  vm->snapshots = (Snapshot **)realloc(vm->snapshots, sizeof(Snapshot*) * (vm->numSnapshots + 1));
+  assert(vm->snapshots != NULL); // Out of memory
+  vm->snapshots[vm->numSnapshots++] = region;
+
+  for(int i = 0; i < vm->stackSize; i++) {
+    vm->stack[i] = freezeValue(&map, frozen, vm->stack[i]);
+  }
+  for(int i = vm->clearedNext; i < vm->clearedCount; i++) {
+    vm->cleared[i] = freezeValue(&map, frozen, vm->cleared[i]);
+  }
+  TRACE(1, "Froze %zu objects.\n", list.count);
+  free(map.objects);
+  free(map.indexes);
+  free(list.objects);
+
+  gc(vm);
+  sweep(vm);
+  return VM_OK;
+}
+
+/* Call this in the child after a fork(). Only the thread that forked
+   comes along, so the VM's GC threads and concurrent marker have to be
+   started again, with locks of their own. The chunk pool that all the
+   VMs share looks after itself. Fork while a concurrent collection is
+   marking and there's no knowing how far the marker had got, so don't:
+   right after vmFreeze() is a good time. */
+void vmForked(VM* vm) {
+  assert(!(vm->marking && vm->concurrent)); // Forked while the marker was marking
+  if(vm->workers) {
+    pthread_mutex_init(&vm->poolLock, NULL);
+    pthread_cond_init(&vm->poolWake, NULL);
+    pthread_cond_init(&vm->poolDone, NULL);
+    /* The new threads start out waiting for the first job. */
+    vm->poolGeneration = 0;
+    vm->poolBusy = 0;
+    for(int i = 1; i < vm->gcThreads; i++) {
+      int result = pthread_create(&vm->workers[i].thread, NULL, poolThread, &vm->workers[i]);
+      assert(result == 0); // Couldn't start a GC thread
+      (void)result;
+    }
+  }
+  if(vm->concurrent) {
+    pthread_mutex_init(&vm->markerLock, NULL);
+    pthread_cond_init(&vm->markerWake, NULL);
+    pthread_cond_init(&vm->markerDone, NULL);
+    int result = pthread_create(&vm->marker, NULL, markerThread, vm);
+    assert(result == 0); // Couldn't start the marker thread
+    (void)result;
+  }
+}
+
+/* Leave main() out when we're being built into something else, like the
+   benchmarks in bench.c. */
+#ifndef BABYVM_NO_MAIN
+
+/* The demo's own commentary. The VM's trace output is buffered, so flush
+   that first to keep the two in order. */
+void say(const char* format, ...) {
+  traceFlush();
+  va_list args;
+  va_start(args, format);
+  vprintf(format, args);
+  va_end(args);
+}
+
+int main() {
+  /* Create a new VM */
+  VMConfig config = defaultConfig();
+  config.initialCapacity = OBJECTS_PER_CHUNK;
+  /* A tiny heap so we get to watch it collect. */
+  config.minHeapBytes = sizeof(Object);
+  VM* vm = newVM(&config);
+
+  say("Adding integer 0 to the stack.\n");
+  pushInt(vm, 0);
+
+  say("Adding integer 1 to the stack.\n");
+  pushInt(vm, 1);
+
+  say("Adding a pair to the stack (consuming two ints already there).\n");
+  pushPair(vm);
+
+  /* The ints are right there in the stack (and now the pair), so the pair
+     is the only thing in the heap. */
+  say("There are now %d objects in stack and %d objects have been allocated.\n", vm->stackSize, vm->numObjects);
+
+  /* Remove it from the stack, simulating the variable no longer being referenced. */
+  say("Popping pair from the stack.\n");
+  pop(vm);
+
+  say("There are now %d objects in stack and %d objects have been allocated.\n", vm->stackSize, vm->numObjects);
+
+  say("Manual invoking GC (should free all)");
+  gc(vm);
+
+  /* Done with the VM! */
+  freeVM(vm);
+
+  /* Now again with a generational VM and a tiny nursery, so we can watch
+     objects get promoted. */
+  say("Creating a generational VM with a nursery of 2 objects.\n");
+  useCollectorPolicy(&config, "generational");
+  config.nurserySize = 2;
+  config.promotionAge = 1;
+  config.minHeapBytes = 4 * sizeof(Object);
+  vm = newVM(&config);
+
+  say("Adding a pair of integers 0 and 1.\n");
+  pushInt(vm, 0);
+  pushInt(vm, 1);
+  pushPair(vm);
+
+  say("Adding a pair of integers 2 and 3 and dropping it again (fills the nursery).\n");
+  pushInt(vm, 2);
+  pushInt(vm, 3);
+  pushPair(vm);
+  pop(vm);
+
+  say("Adding a pair of integers 4 and 5 (a minor GC frees the dropped pair and promotes the first).\n");
+  pushInt(vm, 4);
+  pushInt(vm, 5);
+  pushPair(vm);
+
+  say("There are now %d young and %d old objects.\n", vm->numYoung, vm->numObjects - vm->numYoung);
+
+  const GCStats* stats = vmGetStats(vm);
+  say("That took %ld collections (%ld minor), the last one freeing %d objects. The longest pause was %ldns.\n",
+    stats->collections, stats->minorCollections, stats->last.freed, stats->maxPauseNanos);
+
+  freeVM(vm);
+
+  /* And once more with the copying collector. */
+  say("Creating a VM with the copying collector.\n");
+  config = defaultConfig();
+  useCollectorPolicy(&config, "copying");
+  vm = newVM(&config);
+
+  say("Adding a pair of integers and another pair we'll drop.\n");
+  pushInt(vm, 0);
+  pushInt(vm, 1);
+  pushPair(vm);
+  pushInt(vm, 2);
+  pushInt(vm, 3);
+  pushPair(vm);
+  pop(vm);
+
+  say("Manual invoking GC (should copy just the first pair)");
+  gc(vm);
+
+  freeVM(vm);
+
+  /* Finally, a program for the interpreter rather than calls from C. It
+     counts down from 5 and conses each number onto a list, then throws the
+     counter away. */
+  say("Running a program that builds a list of 5 pairs.\n");
+  vm = newVM(&config);
+  int program[] = {
+    OP_PUSH_INT, 0,   /* list */
+    OP_PUSH_INT, 5,   /* list counter */
+    /* 4: */
+    OP_SWAP,          /* counter list */
+    OP_OVER,          /* counter list counter */
+    OP_SWAP,          /* counter counter list */
+    OP_PAIR,          /* counter list */
+    OP_SWAP,          /* list counter */
+    OP_PUSH_INT, -1,
+    OP_ADD,
+    OP_DUP,
+    OP_JUMP_IF, 4,
+    OP_POP,           /* list */
+    OP_HALT
+  };
+  VMStatus status = vmRun(vm, program);
+  say("The program finished with status %d, leaving %d objects in stack and %d objects allocated.\n",
+    status, vm->stackSize, vm->numObjects);
+
+  freeVM(vm);
+
+  /* And the allocation sampler, watching one bit of code that keeps what
+     it allocates and one that doesn't. */
+  say("Sampling allocations from a list we keep and pairs we drop.\n");
+  config = defaultConfig();
+  config.sampleRate = 10;
+  vm = newVM(&config);
+  vmSetSite(vm, "kept list");
+  pushInt(vm, 0);
+  for(int i = 0; i < 100; i++) {
+    pushInt(vm, i);
+    pushPair(vm);
+  }
+  vmSetSite(vm, "dropped pairs");
+  for(int i = 0; i < 100; i++) {
+    pushInt(vm, i);
+    pushInt(vm, i);
+    pushPair(vm);
+    pop(vm);
+  }
+  gc(vm);
+  traceFlush();
+  printAllocationSites(vm);
+
+  freeVM(vm);
+
+  /* And freezing: a list that's moved out of the heap for good. */
+  say("Freezing a list of 3 pairs.\n");
+  config = defaultConfig();
+  vm = newVM(&config);
+  pushInt(vm, 0);
+  for(int i = 0; i < 3; i++) {
+    pushInt(vm, i);
+    pushPair(vm);
+  }
+  vmFreeze(vm);
+  say("The heap now has %d objects in it, and the list is still there, ending in %d.\n",
+    vm->numObjects, asInt(asObject(vm->stack[0])->tail));
+
+  freeVM(vm);
+
+  /* Last of all, a snapshot: the same list saved to a file and mapped into
+     a new VM, with a pair in the heap pointing into it. */
+  say("Saving a list of 3 pairs to a snapshot and loading it into a new VM.\n");
+  vm = newVM(&config);
+  pushInt(vm, 0);
+  for(int i = 0; i < 3; i++) {
+    pushInt(vm, i);
+    pushPair(vm);
+  }
+  char path[] = "/tmp/babyvm-snapshot-XXXXXX";
+  int fd = mkstemp(path);
+  assert(fd >= 0); // Couldn't make a file for the snapshot
+  close(fd);
+  status = vmSaveSnapshot(vm, path);
+  freeVM(vm);
+  vm = newVM(&config);
+  VMStatus loaded = vmLoadSnapshot(vm, path);
+  /* The snapshot keeps the file open, so it can go now. */
+  unlink(path);
+  say("Saving it finished with status %d and loading it with status %d.\n", status, loaded);
+
+  say("Adding a pair of the list and integer 3, and collecting.\n");
+  pushInt(vm, 3);
+  pushPair(vm);
+  gc(vm);
+  sweep(vm);
+  Object* pair = asObject(vm->stack[0]);
+  say("The heap has %d objects in it, the list still ends in %d, and verifyHeap() found %d problems.\n",
+    vm->numObjects, asInt(asObject(pair->head)->tail), verifyHeap(vm));
+
+  freeVM(vm);
+
+  return 0;
+}
+
+#endif
@@ -0,0 +1,403 @@
+/* Microbenchmarks for the VM. Each workload runs against each collector
+   configuration and prints one line of JSON with how it went, so the
+   numbers can be kept around and compared from one commit to the next.
+
+   Run everything with `make bench`, or pick a workload and/or a
+   configuration by name: ./babybench [workload|all] [config|all] */
+
+#define BABYVM_NO_MAIN
+#include "babyvm.c"
+
+/* Every workload keeps this many pairs alive at the bottom of the stack for
+   the whole run, so there's always something for the GC to mark. */
+#define RETAINED 1000
+
+/* How deep the deep-stack workload's stack goes. */
+#define DEEP_STACK 10000
+
+/* How many pairs the shuffled workload keeps alive. */
+#define SHUFFLED_PAIRS 200000
+
+/* How many objects each workload allocates, give or take. */
+#define WORKLOAD_ALLOCATIONS 2000000
+
+/* How many objects the benchmark has allocated, counted by the helpers
+   below rather than the VM so it costs the VM nothing. Ints don't count,
+   they never touch the heap. */
+long allocations = 0;
+
+void benchPair(VM* vm) {
+  pushPair(vm);
+  allocations++;
+}
+
+/* Push a list of length pairs, each holding an int, linked through their
+   heads. */
+void benchList(VM* vm, int length) {
+  pushInt(vm, 0);
+  for(int i = 0; i < length; i++) {
+    pushInt(vm, i);
+    benchPair(vm);
+  }
+}
+
+/* Lots of little pairs of ints that are garbage as soon as they're made. */
+void churnWorkload(VM* vm) {
+  for(int i = 0; i < WORKLOAD_ALLOCATIONS; i++) {
+    pushInt(vm, i);
+    pushInt(vm, i);
+    benchPair(vm);
+    pop(vm);
+  }
+}
+
+/* Long lists of pairs, made and dropped again. */
+void listWorkload(VM* vm) {
+  int length = 10000;
+  for(int i = 0; i < WORKLOAD_ALLOCATIONS / length; i++) {
+    benchList(vm, length);
+    pop(vm);
+  }
+}
+
+/* The list workload again, but each list built in one go with
+   pushList(). */
+void batchListWorkload(VM* vm) {
+  int length = 10000;
+  int* values = (int *)malloc(sizeof(int) * length);
+  assert(values != NULL); // Out of memory
+  for(int i = 0; i < length; i++) {
+    values[i] = i;
+  }
+  for(int i = 0; i < WORKLOAD_ALLOCATIONS / length; i++) {
+    pushList(vm, values, length);
+    allocations += length;
+    pop(vm);
+  }
+  free(values);
+}
+
+/* A balanced binary tree of the given depth, leaves and all. */
+void benchTree(VM* vm, int depth) {
+  if(depth == 0) {
+    pushInt(vm, 0);
+    return;
+  }
+  benchTree(vm, depth - 1);
+  benchTree(vm, depth - 1);
+  benchPair(vm);
+}
+
+/* Balanced binary trees, made and dropped again. */
+void treeWorkload(VM* vm) {
+  int depth = 14;
+  for(int i = 0; i < WORKLOAD_ALLOCATIONS / (1 << depth); i++) {
+    benchTree(vm, depth);
+    pop(vm);
+  }
+}
+
+/* The tree workload again, but with every pair interned: after the first
+   tree every pushInterned() is a lookup, and nothing is left to collect. */
+void benchInternedTree(VM* vm, int depth) {
+  if(depth == 0) {
+    pushInt(vm, 0);
+    return;
+  }
+  benchInternedTree(vm, depth - 1);
+  benchInternedTree(vm, depth - 1);
+  pushInterned(vm);
+  allocations++;
+}
+
+void internedTreeWorkload(VM* vm) {
+  int depth = 14;
+  for(int i = 0; i < WORKLOAD_ALLOCATIONS / (1 << depth); i++) {
+    benchInternedTree(vm, depth);
+    pop(vm);
+  }
+}
+
+/* Rings of pairs, each one pointing back at the last, made and dropped
+   again. Reference counting can't collect these, we had better. */
+void cycleWorkload(VM* vm) {
+  int length = 100;
+  for(int i = 0; i < WORKLOAD_ALLOCATIONS / length; i++) {
+    benchList(vm, length);
+    Value last = vm->stack[vm->stackSize - 1];
+    Object* first = asObject(last);
+    while(isObject(first->head)) {
+      first = asObject(first->head);
+    }
+    setHead(vm, first, last);
+    pop(vm);
+  }
+}
+
+/* Garbage pairs on top of a stack DEEP_STACK pairs deep, so every
+   collection has all those roots to get through. */
+void deepStackWorkload(VM* vm) {
+  while(vm->stackSize < DEEP_STACK) {
+    pushInt(vm, 0);
+    pushInt(vm, 1);
+    benchPair(vm);
+  }
+  for(int i = 0; i < WORKLOAD_ALLOCATIONS; i++) {
+    pushInt(vm, i);
+    pushInt(vm, i);
+    benchPair(vm);
+    pop(vm);
+  }
+}
+
+/* A big binary tree whose pairs are linked up in a random order, so
+   marking it jumps all over memory, on top of the churn workload. */
+void shuffledWorkload(VM* vm) {
+  Object** pairs = (Object **)malloc(sizeof(Object*) * SHUFFLED_PAIRS);
+  int* order = (int *)malloc(sizeof(int) * SHUFFLED_PAIRS);
+  assert(pairs != NULL && order != NULL); // Out of memory
+
+  /* The pairs stay on the stack until they're all linked up. The copying
+     collector can move them while we're still making more, so we only
+     look at where they ended up once they're all made. */
+  int base = vm->stackSize;
+  for(int i = 0; i < SHUFFLED_PAIRS; i++) {
+    pushInt(vm, 0);
+    pushInt(vm, 0);
+    benchPair(vm);
+    order[i] = i;
+  }
+  for(int i = 0; i < SHUFFLED_PAIRS; i++) {
+    pairs[i] = asObject(vm->stack[base + i]);
+  }
+  unsigned int seed = 1;
+  for(int i = SHUFFLED_PAIRS - 1; i > 0; i--) {
+    int j = (int)(rand_r(&seed) % (unsigned int)(i + 1));
+    int swap = order[i];
+    order[i] = order[j];
+    order[j] = swap;
+  }
+  /* The pair at order[i] has the ones at order[2i+1] and order[2i+2] as
+     its children. */
+  for(int i = 0; i < SHUFFLED_PAIRS; i++) {
+    Object* pair = pairs[order[i]];
+    if(2 * i + 1 < SHUFFLED_PAIRS) setHead(vm, pair, objectValue(pairs[order[2 * i + 1]]));
+    if(2 * i + 2 < SHUFFLED_PAIRS) setTail(vm, pair, objectValue(pairs[order[2 * i + 2]]));
+  }
+  Object* root = pairs[order[0]];
+  for(int i = 0; i < SHUFFLED_PAIRS; i++) {
+    pop(vm);
+  }
+  push(vm, objectValue(root));
+  free(pairs);
+  free(order);
+
+  churnWorkload(vm);
+}
+
+/* Arrays of pairs and byte buffers, some of them big enough to get their
+   own mappings, made and dropped again. */
+void arraysWorkload(VM* vm) {
+  int length = 1000;
+  for(int i = 0; i < WORKLOAD_ALLOCATIONS / length; i++) {
+    for(int j = 0; j < length; j++) {
+      pushInt(vm, j);
+      pushInt(vm, j);
+      benchPair(vm);
+    }
+    pushArray(vm, length);
+    allocations++;
+    Object* bytes = newBytes(vm, (size_t)(i % 8) * 8192);
+    allocations++;
+    (void)bytes;
+    pop(vm);
+  }
+}
+
+/* A cache of derived values held through weak references, on top of the
+   churn workload: every so often a list gets made and cached, and the
+   cache's entries get cleared whenever a collection finds nothing else
+   holding on to them. Cleared entries come back through pushCleared() and
+   get filled in again. */
+void weakCacheWorkload(VM* vm) {
+  int entries = 1000;
+  /* The copying collector moves the cache around, so we always go through
+     its slot on the stack. */
+  int slot = vm->stackSize;
+  push(vm, objectValue(newArray(vm, (size_t)entries)));
+  allocations++;
+  for(int i = 0; i < WORKLOAD_ALLOCATIONS / 2; i++) {
+    if(i % 100 == 0) {
+      int entry = (i / 100) % entries;
+      benchList(vm, 10);
+      pushInt(vm, entry);
+      Object* weak = pushWeak(vm);
+      allocations++;
+      setElement(vm, asObject(vm->stack[slot]), (size_t)entry, objectValue(weak));
+      pop(vm);
+    }
+    pushInt(vm, i);
+    pushInt(vm, i);
+    benchPair(vm);
+    pop(vm);
+    /* The entry might have been filled in again since, so only empty it if
+       it's still the cleared one. */
+    int pushed;
+    while(pushCleared(vm, &pushed) == VM_OK && pushed) {
+      Object* cache = asObject(vm->stack[slot]);
+      size_t entry = (size_t)asInt(pop(vm));
+      Value weak = arrayElements(cache)[entry];
+      if(isObject(weak) && weakTarget(vm, asObject(weak)) == NIL_VALUE) {
+        setElement(vm, cache, entry, NIL_VALUE);
+      }
+    }
+  }
+  pop(vm);
+}
+
+/* A long list that's kept for the whole run, built a pair at a time from
+   one allocation site with garbage pairs from another in between, so
+   pretenuring has something to tell apart. */
+void longLivedWorkload(VM* vm) {
+  /* The list stays on top of the stack, linked through its heads. */
+  push(vm, NIL_VALUE);
+  for(int i = 0; i < WORKLOAD_ALLOCATIONS / 4; i++) {
+    vmSetSite(vm, "table");
+    pushInt(vm, i);
+    benchPair(vm);
+    vmSetSite(vm, "temporaries");
+    for(int j = 0; j < 3; j++) {
+      pushInt(vm, i);
+      pushInt(vm, j);
+      benchPair(vm);
+      pop(vm);
+    }
+  }
+  pop(vm);
+}
+
+/* The list workload again, but as a program for vmRun() rather than calls
+   from C. */
+void bytecodeWorkload(VM* vm) {
+  int length = 10000;
+  int lists = WORKLOAD_ALLOCATIONS / length;
+  int program[] = {
+    OP_PUSH_INT, lists,  /* lists */
+    /* 2: */
+    OP_PUSH_INT, 0,      /* lists list */
+    OP_PUSH_INT, length, /* lists list counter */
+    /* 6: */
+    OP_SWAP,             /* lists counter list */
+    OP_OVER,             /* lists counter list counter */
+    OP_SWAP,             /* lists counter counter list */
+    OP_PAIR,             /* lists counter list */
+    OP_SWAP,             /* lists list counter */
+    OP_PUSH_INT, -1,
+    OP_ADD,
+    OP_DUP,
+    OP_JUMP_IF, 6,
+    OP_POP,              /* lists list */
+    OP_POP,              /* lists */
+    OP_PUSH_INT, -1,
+    OP_ADD,
+    OP_DUP,
+    OP_JUMP_IF, 2,
+    OP_POP,
+    OP_HALT
+  };
+  VMStatus status = vmRun(vm, program);
+  assert(status == VM_OK);
+  (void)status;
+  allocations += (long)lists * length;
+}
+
+typedef struct {
+  const char* name;
+  void (*run)(VM* vm);
+} Workload;
+
+Workload workloads[] = {
+  { "churn", churnWorkload },
+  { "list", listWorkload },
+  { "batch-list", batchListWorkload },
+  { "tree", treeWorkload },
+  { "interned-tree", internedTreeWorkload },
+  { "cycle", cycleWorkload },
+  { "deep-stack", deepStackWorkload },
+  { "shuffled", shuffledWorkload },
+  { "bytecode", bytecodeWorkload },
+  { "arrays", arraysWorkload },
+  { "weak-cache", weakCacheWorkload },
+  { "long-lived", longLivedWorkload },
+};
+
+/* The collector configurations we try each workload with: every one of
+   the VM's collector policies. */
+typedef struct {
+  const char* name;
+  VMConfig config;
+} BenchConfig;
+
+BenchConfig benchConfigs[NUM_COLLECTOR_POLICIES];
+int numBenchConfigs = 0;
+
+void setUpBenchConfigs() {
+  for(int i = 0; i < NUM_COLLECTOR_POLICIES; i++) {
+    VMConfig config = defaultConfig();
+    useCollectorPolicy(&config, collectorPolicies[i].name);
+    benchConfigs[numBenchConfigs].name = collectorPolicies[i].name;
+    benchConfigs[numBenchConfigs].config = config;
+    numBenchConfigs++;
+  }
+}
+
+void runBenchmark(Workload* workload, BenchConfig* benchConfig) {
+  VM* vm = newVM(&benchConfig->config);
+  allocations = 0;
+
+  long start = nanoTime();
+  benchList(vm, RETAINED);
+  workload->run(vm);
+  long nanos = nanoTime() - start;
+
+  const GCStats* stats = vmGetStats(vm);
+  printf("{\"workload\":\"%s\",\"config\":\"%s\",\"allocations\":%ld,\"ns\":%ld,"
+         "\"ns_per_alloc\":%.2f,\"collections\":%ld,\"minor_collections\":%ld,"
+         "\"marked_per_sec\":%.0f,\"mark_ns\":%ld,\"sweep_ns\":%ld,"
+         "\"pauses\":%ld,\"pause_ns\":%ld,\"pause_p50_ns\":%ld,\"pause_p90_ns\":%ld,"
+         "\"pause_p99_ns\":%ld,\"pause_p999_ns\":%ld,\"pause_max_ns\":%ld}\n",
+    workload->name, benchConfig->name, allocations, nanos,
+    allocations ? (double)nanos / allocations : 0.0,
+    stats->collections, stats->minorCollections,
+    stats->totalMarkNanos ? stats->totalMarked * 1e9 / stats->totalMarkNanos : 0.0,
+    stats->totalMarkNanos, stats->totalSweepNanos,
+    stats->pauses, stats->totalPauseNanos,
+    pausePercentile(stats, 50), pausePercentile(stats, 90),
+    pausePercentile(stats, 99), pausePercentile(stats, 99.9),
+    stats->maxPauseNanos);
+  fflush(stdout);
+
+  freeVM(vm);
+}
+
+int main(int argc, char** argv) {
+  const char* onlyWorkload = argc > 1 ? argv[1] : "all";
+  const char* onlyConfig = argc > 2 ? argv[2] : "all";
+  setUpBenchConfigs();
+
+  int ran = 0;
+  for(int i = 0; i < (int)(sizeof(workloads) / sizeof(workloads[0])); i++) {
+    if(strcmp(onlyWorkload, "all") != 0 && strcmp(onlyWorkload, workloads[i].name) != 0) continue;
+    for(int j = 0; j < numBenchConfigs; j++) {
+      if(strcmp(onlyConfig, "all") != 0 && strcmp(onlyConfig, benchConfigs[j].name) != 0) continue;
+      runBenchmark(&workloads[i], &benchConfigs[j]);
+      ran++;
+    }
+  }
+
+  if(ran == 0) {
+    fprintf(stderr, "Nothing matched \"%s\" \"%s\".\n", onlyWorkload, onlyConfig);
+    return 1;
+  }
+  return 0;
+}